@@ -1,3 +1,4 @@
+#include <new>
 #include <utility>
 #include "trie.h"
 #include "trie.hpp"
@@ -87,6 +88,28 @@ void trie<T>::insert(const char* key, const T& value)
 }
 
 
+template<typename T>
+bool trie<T>::insert_or_assign(const char* key, const T& value)
+{
+	int inserted;
+	void** slot = trie_upsert(t, (char*)key, &inserted);
+	if (not slot)
+		throw std::bad_alloc();
+	if (not inserted) {
+		*static_cast<T*>(*slot) = value;
+		return false;
+	}
+	try {
+		*slot = new T(value);
+	} catch (...) {
+		/* The key was added with an empty slot, which must not stay */
+		trie_delete(t, (char*)key);
+		throw;
+	}
+	return true;
+}
+
+
 template<typename T>
 void trie<T>::remove(const char* key)
 {
@@ -106,13 +129,19 @@ typename trie<T>::iterator trie<T>::find(const char* key)
 template<typename T>
 T& trie<T>::operator[](const char* key)
 {
-	T* found = static_cast<T*>(trie_find(t, (char*)key));
-	if (not found) {
-		T* newVal = new T();
-		trie_insert(t, (char*)key, (void*)newVal);
-		return *newVal;
+	int inserted;
+	void** slot = trie_upsert(t, (char*)key, &inserted);
+	if (not slot)
+		throw std::bad_alloc();
+	if (inserted) {
+		try {
+			*slot = new T();
+		} catch (...) {
+			trie_delete(t, (char*)key);
+			throw;
+		}
 	}
-	return *found;
+	return *static_cast<T*>(*slot);
 }
 
 
@@ -120,7 +149,7 @@ template<typename T>
 typename trie<T>::iterator trie<T>::begin()
 {
 	iterator it;
-	it.iter = trie_findall(t, "", maxKeylenAdded());
+	it.iter = trie_findall(t, "", TRIE_KEYLEN_ANY);
 	return it;
 }
 
@@ -246,6 +275,14 @@ public:
 };
 
 
+struct Unbuildable {
+	Unbuildable()
+	{
+		throw 0;
+	}
+};
+
+
 #if 1
 int main()
 {
@@ -274,7 +311,10 @@ int main()
 		printf("world does not exist\n");
 	printf("max added: %ld\n", T.maxKeylenAdded());
 
-	T.insert("world", 7.5);
+	if (T.insert_or_assign("world", 7.5))
+		printf("world inserted\n");
+	if (not T.insert_or_assign("world", 8.5))
+		printf("world assigned %f\n", T["world"]);
 	printf("Iterator test:\n");
 	for (const auto& kv : T)
 		printf("\tKey: %s, Value: %f\n", kv.first, kv.second);
@@ -282,6 +322,13 @@ int main()
 	for (const auto& kv : T.getSubtrie("w", 64))
 		printf("\tKey: %s, Value: %f\n", kv.first, kv.second);
 
+	trie<Unbuildable> U;
+	try {
+		U["key"];
+	} catch (int) { }
+	if (U.find("key") == U.end())
+		printf("key not left behind by a throwing constructor\n");
+
 	return 0;
 }
 #endif
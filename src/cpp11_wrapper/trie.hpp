@@ -61,6 +61,7 @@ public:
 	~trie();
 	size_t maxKeylenAdded();
 	void insert(const char* key, const T& value);
+	bool insert_or_assign(const char* key, const T& value);
 	void remove(const char* key);
 	iterator find(const char* key);
 	T& operator[](const char* key);
@@ -0,0 +1,209 @@
+#include "pool.h"
+
+
+#define ALLOC(x, type) (x = (type*)malloc(sizeof *(x)))
+
+#define POOL_ALIGN 16
+#define POOL_N_CLASSES 64
+#define POOL_MAX_CLASS (POOL_ALIGN * POOL_N_CLASSES)
+#define ROUND_UP(n) (((n) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+
+typedef struct pool_chunk {
+	struct pool_chunk *prev, *next;
+} PoolChunk;
+
+typedef struct pool_block {
+	struct pool_block* next;
+} PoolBlock;
+
+struct pool {
+	PoolChunk* chunks;
+	char *bump, *bump_end;
+	size_t chunk_size;
+	size_t in_use;
+	PoolBlock* free_lists[POOL_N_CLASSES];
+};
+#ifndef POOL_FWD
+#define POOL_FWD
+typedef struct pool Pool;
+#endif /* POOL_FWD */
+
+#define CHUNK_HDR ROUND_UP(sizeof(PoolChunk))
+
+
+static void* chunk_create(Pool* p, size_t size)
+{
+	PoolChunk* chunk;
+	if (!(chunk = (PoolChunk*)malloc(CHUNK_HDR + size)))
+		return NULL;
+	chunk->prev = NULL;
+	chunk->next = p->chunks;
+	if (p->chunks)
+		p->chunks->prev = chunk;
+	p->chunks = chunk;
+	return (char*)chunk + CHUNK_HDR;
+}
+
+
+static void chunk_destroy(Pool* p, void* data)
+{
+	PoolChunk* chunk = (PoolChunk*)((char*)data - CHUNK_HDR);
+	if (chunk->prev)
+		chunk->prev->next = chunk->next;
+	else
+		p->chunks = chunk->next;
+	if (chunk->next)
+		chunk->next->prev = chunk->prev;
+	free(chunk);
+}
+
+
+static inline size_t size_class(size_t size)
+{
+	return size ? (size - 1) / POOL_ALIGN : 0;
+}
+
+
+static void block_release(Pool* p, void* ptr, size_t size)
+{
+	PoolBlock* block = (PoolBlock*)ptr;
+	size_t cls = size_class(size);
+	block->next = p->free_lists[cls];
+	p->free_lists[cls] = block;
+}
+
+
+static void* bump_refill(Pool* p, size_t size)
+{
+	char* data;
+	if (!(data = (char*)chunk_create(p, p->chunk_size)))
+		return NULL;
+	if (p->bump_end > p->bump)
+		block_release(p, p->bump, (size_t)(p->bump_end - p->bump));
+	p->bump = data + size;
+	p->bump_end = data + p->chunk_size;
+	return data;
+}
+
+
+Pool* pool_create(size_t chunk_size)
+{
+	Pool* p;
+	if (!ALLOC(p, Pool))
+		return NULL;
+	p->chunks = NULL;
+	p->bump = p->bump_end = NULL;
+	p->chunk_size = ROUND_UP(chunk_size < POOL_MAX_CLASS ?
+				 POOL_MAX_CLASS : chunk_size);
+	p->in_use = 0;
+	for (size_t i = 0; i < POOL_N_CLASSES; ++i)
+		p->free_lists[i] = NULL;
+	return p;
+}
+
+
+Pool* pool_create_heap(void)
+{
+	Pool* p;
+	if (!(p = pool_create(0)))
+		return NULL;
+	p->chunk_size = 0;
+	return p;
+}
+
+
+static void* block_alloc(Pool* p, size_t size)
+{
+	if (!p->chunk_size)
+		return malloc(size);
+	if (size > POOL_MAX_CLASS)
+		return chunk_create(p, size);
+
+	size_t cls = size_class(size);
+	PoolBlock* block = p->free_lists[cls];
+	if (block) {
+		p->free_lists[cls] = block->next;
+		return block;
+	}
+
+	size_t rounded = ROUND_UP(size ? size : 1);
+	if ((size_t)(p->bump_end - p->bump) < rounded)
+		return bump_refill(p, rounded);
+	void* result = p->bump;
+	p->bump += rounded;
+	return result;
+}
+
+
+void* pool_alloc(Pool* p, size_t size)
+{
+	if (!p)
+		return malloc(size);
+
+	void* result = block_alloc(p, size);
+	if (result)
+		p->in_use += size;
+	return result;
+}
+
+
+void pool_free(Pool* p, void* ptr, size_t size)
+{
+	if (!p) {
+		free(ptr);
+		return;
+	}
+	if (!ptr)
+		return;
+
+	p->in_use -= size;
+	if (!p->chunk_size)
+		free(ptr);
+	else if (size > POOL_MAX_CLASS)
+		chunk_destroy(p, ptr);
+	else
+		block_release(p, ptr, size);
+}
+
+
+size_t pool_in_use(const Pool* p)
+{
+	return p ? p->in_use : 0;
+}
+
+
+/* Moves size bytes in use from one heap pool to another. Blocks carved out of
+ * chunks cannot change hands, so other pools refuse with -1. */
+int pool_adopt(Pool* p, Pool* from, size_t size)
+{
+	if (!p || !from || p->chunk_size || from->chunk_size
+	    || from->in_use < size)
+		return -1;
+	from->in_use -= size;
+	p->in_use += size;
+	return 0;
+}
+
+
+void pool_destroy(Pool* p)
+{
+	if (!p)
+		return;
+
+	PoolChunk* chunk = p->chunks;
+	while (chunk) {
+		PoolChunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	free(p);
+}
+
+
+#undef ALLOC
+#undef POOL_ALIGN
+#undef POOL_N_CLASSES
+#undef POOL_MAX_CLASS
+#undef ROUND_UP
+#undef CHUNK_HDR
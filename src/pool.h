@@ -0,0 +1,54 @@
+/**
+ * @file pool.h
+ * @brief Methods for chunked memory pool operations.
+ */
+
+
+#ifndef POOL
+#define POOL
+
+
+#include <stdlib.h>
+#include <string.h>
+
+
+/** Default number of bytes requested from the system per chunk. */
+#define POOL_CHUNK_SIZE 65536
+
+
+/**
+ * Memory pool carving small blocks out of large chunks.
+ *
+ * Blocks are freed back to per-size free lists and reused by subsequent
+ * allocations. Blocks larger than the biggest size class are allocated
+ * individually but still owned by the pool, so that destroying the pool
+ * releases all of its memory in time proportional to the number of chunks.
+ *
+ * Blocks must be freed with the same size they were allocated with.
+ *
+ * All functions accept a NULL pool, in which case they forward to
+ * <code>malloc()</code> and <code>free()</code>.
+ *
+ * A pool made by <code>pool_create_heap()</code> forwards every allocation to
+ * <code>malloc()</code> as well, but like any other pool it counts the bytes
+ * in use, as reported by <code>pool_in_use()</code>. Blocks allocated from it
+ * are not released by <code>pool_destroy()</code>. Since its blocks do not
+ * live in chunks, another heap pool can take them over with
+ * <code>pool_adopt()</code>, after which they must be freed through it.
+ */
+struct pool;
+#ifndef POOL_FWD
+#define POOL_FWD
+typedef struct pool Pool;
+#endif /* POOL_FWD */
+
+Pool* pool_create(size_t chunk_size);
+Pool* pool_create_heap(void);
+void* pool_alloc(Pool* p, size_t size);
+void pool_free(Pool* p, void* ptr, size_t size);
+size_t pool_in_use(const Pool* p);
+int pool_adopt(Pool* p, Pool* from, size_t size);
+void pool_destroy(Pool* p);
+
+
+#endif /* POOL */
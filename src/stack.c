@@ -3,14 +3,12 @@
 
 #define ALLOC(x, type) (x = (type*)malloc(sizeof *(x)))
 
+#define STACK_MIN_CAPACITY 16
 
-typedef struct stack_elem {
-	void* val;
-	struct stack_elem* next;
-} StackElem;
 
 struct stack {
-	StackElem* head;
+	void** vals;
+	size_t size, capacity;
 	struct stack_ops ops;
 };
 #ifndef STACK_FWD
@@ -22,11 +20,10 @@ typedef struct stack Stack;
 Stack* stack_create(const struct stack_ops ops)
 {
 	Stack* s;
-	if (!ALLOC(s, Stack)) {
-		free(s);
+	if (!ALLOC(s, Stack))
 		return NULL;
-	}
-	s->head = NULL;
+	s->vals = NULL;
+	s->size = s->capacity = 0;
 	s->ops = ops;
 	return s;
 }
@@ -34,39 +31,35 @@ Stack* stack_create(const struct stack_ops ops)
 
 int stack_push(Stack* s, void* data)
 {
-	StackElem* head_new;
-	if (!ALLOC(head_new, StackElem))
-		return -1;
-	head_new->val = data;
-	head_new->next = s->head;
-
-	s->head = head_new;
+	if (s->size == s->capacity) {
+		size_t capacity = s->capacity ? 2 * s->capacity
+					      : STACK_MIN_CAPACITY;
+		void** vals;
+		if (!(vals = (void**)realloc(s->vals, capacity * sizeof *vals)))
+			return -1;
+		s->vals = vals;
+		s->capacity = capacity;
+	}
+	s->vals[s->size++] = data;
 	return 0;
 }
 
 
 void* stack_pop(Stack* s)
 {
-	StackElem* head = s->head;
-
-	if (!head)
-		return NULL;
-	void* val = head->val;
-	s->head = head->next;
-	free(head);
-	return val;
+	return s->size ? s->vals[--s->size] : NULL;
 }
 
 
 void* stack_top(Stack* s)
 {
-	return s->head ? s->head->val : NULL;
+	return s->size ? s->vals[s->size - 1] : NULL;
 }
 
 
 bool stack_empty(Stack* s)
 {
-	return s->head == NULL;
+	return s->size == 0;
 }
 
 
@@ -75,18 +68,14 @@ void stack_destroy(Stack* s)
 	if (!s)
 		return;
 
-	StackElem* elem = s->head;
 	void (*dtor)(void*) = s->ops.dtor;
-
-	while (elem) {
-		StackElem* next = elem->next;
-		if (dtor)
-			dtor(elem->val);
-		free(elem);
-		elem = next;
-	}
+	if (dtor)
+		while (s->size)
+			dtor(s->vals[--s->size]);
+	free(s->vals);
 	free(s);
 }
 
 
 #undef ALLOC
+#undef STACK_MIN_CAPACITY
@@ -1,24 +1,168 @@
 #include <stdbool.h>
 
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(TRIE_NO_SIMD)
+#define TRIE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && !defined(TRIE_NO_SIMD)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define TRIE_WORD_CMP
+#endif
+#endif
+
+/* Child searches and segment comparisons sit on every lookup path, so they
+ * are inlined even where that exceeds the inlining limits of the compiler */
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#else
+#define PREFETCH(addr) ((void)(addr))
+#define FORCE_INLINE inline
+#endif
+
 #include "trie.h"
-#include "stack.h"
+#include "pool.h"
 
 
 #define VALLOC(x, type, n) (x = (type*)malloc((n) * sizeof *(x)))
 #define ALLOC(x, type) VALLOC(x, type, 1)
 
+/* Segments shorter than this are stored inside the node */
+#define SEG_LOCAL_SIZE 16
+
+/* Child vectors of up to NODE16_MAX children are searched by comparing the
+ * packed first bytes of all children at once with SSE2, or by a scalar scan
+ * above NODE4_MAX children otherwise. Wider vectors are dispatched through a
+ * byte index. Segments are compared 16 or 8 bytes at a time. Define
+ * TRIE_NO_SIMD to force byte-wise searches and comparisons. */
+#define NODE4_MAX 4
+#define NODE16_MAX 16
+#define NODE_INDEX_SIZE 256
+#define NODE_MAX_CAPACITY 256
+
+/* The root table maps the first two key bytes to the node they lead to */
+#define ROOT_TABLE_ROWS 256
+
+/* Iterator keys start with this much room and grow as needed */
+#define KEY_MIN_CAPACITY 64
+
+/* Walks keep this many frames inline before moving the stack to the heap */
+#define WALK_LOCAL_DEPTH 32
+
+/* Batched lookups keep this many keys in flight, each waiting on the node
+ * prefetched for it while the others advance */
+#define FIND_BATCH_WIDTH 16
+
+/* Splits cut at the first level below the prefix holding this many nodes per
+ * piece, so that pieces hold similar numbers of subtrees */
+#define SPLIT_LEVEL_NODES 8
+
+/* Batches sort ranges of at most this many keys by insertion rather than by
+ * distributing them among buckets */
+#define BATCH_SORT_SMALL 32
+
+/* Batches add runs of up to this many new leaves under one node in a single
+ * merge with its children */
+#define BATCH_LEAVES 16
+
+/* Batches on tries of at least this many nodes, which seldom stay in cache,
+ * look up the paths of the next FIND_BATCH_WIDTH ops together before
+ * applying them */
+#define BATCH_WARM_NODES (1 << 16)
+
 
 typedef struct TrieNode {
-	char* segment;
-	size_t n_children;
+	union {
+		char* heap;
+		char local[SEG_LOCAL_SIZE];
+	} seg;
+	size_t seglen;
 	struct TrieNode* children;
 	void* value;
+	unsigned short n_children;
+	unsigned short capacity;
 } TrieNode;
 
+/* The node in nodes[b0 << 8 | b1] is either rows[b0], the child of the root
+ * for b0, or the child of rows[b0] for b1 if the segment of rows[b0] is b0 */
+typedef struct RootTable {
+	TrieNode* rows[ROOT_TABLE_ROWS];
+	TrieNode* nodes[ROOT_TABLE_ROWS * ROOT_TABLE_ROWS];
+} RootTable;
+
+/* Frame of a walk positioned at the child at index of node, whose segment
+ * follows keylen bytes of key */
+typedef struct WalkFrame {
+	TrieNode* node;
+	size_t index, keylen;
+} WalkFrame;
+
+/* Node to fill with the keys in [lo, hi), which share their first pos bytes */
+typedef struct BuildFrame {
+	TrieNode* node;
+	size_t lo, hi, pos;
+} BuildFrame;
+
+/* Subtree taken out of the trie and waiting to be grafted into dst, whose
+ * key is the key of src */
+typedef struct GraftFrame {
+	TrieNode* dst;
+	TrieNode src;
+} GraftFrame;
+
+typedef struct GraftStack {
+	GraftFrame* frames;
+	size_t depth, capacity;
+	GraftFrame local[WALK_LOCAL_DEPTH];
+} GraftStack;
+
+/* Lookup in flight in a batch. The lane is fetched once the segment and
+ * child keys of node have been prefetched, and matched if the segment of
+ * node needs no comparison. */
+typedef struct FindLane {
+	const TrieNode* node;
+	const char* key;
+	size_t len, keypos, index;
+	bool fetched, matched;
+} FindLane;
+
+/* Batch op in order with 8 bytes of its key while it is sorted, so that
+ * sorting seldom follows the key pointer, and then with the number of bytes
+ * its key shares with the key of the op before it in the batch */
+typedef struct BatchKey {
+	union {
+		unsigned long long head;
+		size_t common;
+	} prefix;
+	size_t index;
+} BatchKey;
+
+/* Ops from lo to hi in the batch order whose keys share their first offset
+ * bytes, with heads holding their bytes from base on. The key at lo shares
+ * common bytes with the key before it. */
+typedef struct BatchRange {
+	size_t lo, hi, offset, base, common;
+} BatchRange;
+
+typedef struct TrieWalk {
+	WalkFrame* frames;
+	size_t depth, capacity;
+	WalkFrame local[WALK_LOCAL_DEPTH];
+} TrieWalk;
+
 struct Trie {
 	TrieNode* root;
 	struct TrieOps* ops;
+	Pool* pool;
+	RootTable* root_table;
+	unsigned flags;
 	size_t max_keylen_added;
+	size_t n_keys, n_nodes, value_bytes;
+	/* Slot handed out by the last upsert, until the next change, so that
+	 * its value is measured once the caller has stored it and a new key
+	 * can be deleted while the slot is still empty */
+	void** upserted;
 };
 #ifndef TRIE_FWD
 #define TRIE_FWD
@@ -26,9 +170,13 @@ typedef struct Trie Trie;
 #endif /* TRIE_FWD */
 
 struct TrieIterator {
-	Stack *node_stack, *keyptr_stack;
+	TrieWalk walk;
+	TrieNode* start;
+	/* Nodes a range iterator may not move back from or forward to */
+	TrieNode *first, *end;
 	size_t max_keylen;
 	char* key;
+	size_t keylen, keycap;
 	void* value;
 };
 #ifndef TRIE_ITER_FWD
@@ -41,62 +189,181 @@ typedef size_t (*memusage_t)(void*);
 
 
 /* Utility functions */
-static char* str_dup(const char*);
-static char* str_n_dup(const char*, size_t);
-static char* add_strs(const char*, const char*);
+static char* add_strs(Pool*, const char*, size_t, const char*, size_t);
+static inline char* node_seg(const TrieNode*);
+static int node_setseg(Pool*, TrieNode*, const char*, size_t);
+static inline void seg_free(Pool*, TrieNode*);
 static inline char* key_buffer_create(size_t);
 static inline char* segncpy(char*, const char*, size_t);
-static inline char* key_add_segment(char*, const char*, char*, size_t);
-static inline ptrdiff_t pflen_equal(const char*, const char*);
+static int key_reserve(TrieIterator*, size_t);
+static FORCE_INLINE size_t pflen(const char*, const char*, size_t);
 static void val_insert(TrieNode*, void*, destructor_t);
+static void val_count(Trie*, void*, void*);
+static size_t upsert_pending(const Trie*);
+static void upsert_settle(Trie*);
 
 /* DFS auxiliaries */
-static size_t node_memory_usage(TrieNode*, memusage_t);
+static void walk_init(TrieWalk*);
+static int walk_push(TrieWalk*, TrieNode*, size_t, size_t);
+static void walk_release(TrieWalk*);
 
 /* Search functions */
-static inline TrieNode* leq_child(TrieNode*, char);
-static void find_mismatch(Trie*, const char*, TrieNode**, TrieNode**, char**,
-			  char**);
+static FORCE_INLINE size_t keys_scan(const unsigned char*, size_t,
+				     unsigned char);
+static FORCE_INLINE TrieNode* find_child(const TrieNode*, unsigned char);
+static inline size_t child_rank(const TrieNode*, unsigned char);
+static inline size_t seg_match(const TrieNode*, const char*, size_t);
+static int insert_at(Trie*, const char*, size_t, void*, TrieNode*, size_t,
+		     size_t);
+static TrieNode* delete_at(Trie*, const char*, size_t, TrieNode*, TrieNode*,
+			   size_t, size_t);
+static void find_mismatch(Trie*, const char*, size_t, TrieNode**, TrieNode**,
+			  size_t*, size_t*);
+
+/* Batch functions */
+static bool batch_lt(const struct TrieBatchOp*, const struct TrieBatchOp*,
+		     size_t);
+static bool batch_sorted(const struct TrieBatchOp*, BatchKey*, size_t);
+static void batch_heads(const struct TrieBatchOp*, BatchKey*, size_t, size_t);
+static bool batch_key_lt(const struct TrieBatchOp*, const BatchKey*,
+			 const BatchKey*, const BatchRange*);
+static void batch_insertion(const struct TrieBatchOp*, BatchKey*,
+			    const BatchRange*);
+static void batch_sort(const struct TrieBatchOp*, BatchKey*, BatchKey*,
+		       BatchRange*, size_t);
+static size_t batch_group_end(const struct TrieBatchOp*, const BatchKey*,
+			      size_t, size_t, size_t);
+static size_t batch_capacity(const TrieNode*, const struct TrieBatchOp*,
+			     const BatchKey*, size_t, size_t, size_t);
+static void batch_reserve(Trie*, TrieNode*, const struct TrieBatchOp*,
+			  const BatchKey*, size_t, size_t, size_t);
+static size_t batch_leaves(Trie*, TrieNode*, struct TrieBatchOp*,
+			   const BatchKey*, size_t, size_t, size_t);
+static void batch_warm(Trie*, const struct TrieBatchOp*, const BatchKey*,
+		       size_t, size_t);
+static void batch_apply(Trie*, struct TrieBatchOp*, const BatchKey*, size_t);
+
+/* Graft functions */
+static void graft_init(GraftStack*);
+static int graft_push(GraftStack*, TrieNode*, const TrieNode*);
+static void graft_release(GraftStack*);
+static inline TrieNode* graft_match(const TrieNode*, unsigned char,
+				    const TrieNode*);
+static int graft_reserve(Pool*, TrieNode*, size_t, TrieNode**);
+static TrieNode* graft_path(Trie*, const char*, size_t, TrieNode**, size_t*);
+static int graft_prepare(Trie*, Trie*, GraftStack*, TrieNode*,
+			 const TrieNode*, TrieNode**);
+static void node_graft(Trie*, GraftStack*, TrieNode*, const TrieNode*,
+		       TrieResolver);
+static int move_all(Trie*, const char*, size_t);
+static void node_unlink(TrieNode*);
+static int node_clone(Pool*, TrieNode*);
+
+/* Batched lookup functions */
+static void find_lane_start(Trie*, FindLane*, const char*, size_t, size_t);
+static bool find_lane_step(FindLane*);
+
+/* Child vector functions */
+static inline size_t children_size(size_t);
+static inline unsigned char* node_keys(const TrieNode*);
+static inline unsigned char* node_index(const TrieNode*);
+static inline unsigned char node_byte(const TrieNode*);
+static void children_reindex(TrieNode*, size_t);
+static int children_resize(Pool*, TrieNode*, size_t, size_t);
+static void children_insert(TrieNode*, const TrieNode*);
+static void children_remove(TrieNode*, const TrieNode*);
 
 /* Deletion functions */
-static void node_recursive_free(TrieNode*, destructor_t);
-static void raw_node_destroy(TrieNode*);
-static int node_delchild(TrieNode*, TrieNode*, destructor_t);
+static void node_destroy_all(Pool*, TrieNode*, destructor_t, bool, Trie*);
+static void raw_node_destroy(Pool*, TrieNode*);
+static void node_delchild(Pool*, TrieNode*, TrieNode*, destructor_t);
 
 /* Addition functions */
-static TrieNode* node_create(char*, void*);
-static int node_split(TrieNode*, char*);
-static int node_merge(TrieNode* node, destructor_t);
-static int node_fork(TrieNode*, char*, TrieNode*);
-static int node_addchild(TrieNode*, TrieNode*);
-static int node_branch(TrieNode*, char*, TrieNode*);
+static TrieNode* node_create(Pool*, const char*, size_t, void*);
+static int node_init(Pool*, TrieNode*, const char*, size_t, void*);
+static int node_split(Pool*, TrieNode*, size_t);
+static int node_merge(Pool*, TrieNode* node, destructor_t);
+static int node_fork(Pool*, TrieNode*, size_t, TrieNode*);
+static int node_addchild(Pool*, TrieNode*, TrieNode*);
+static int node_branch(Pool*, TrieNode*, size_t, TrieNode*);
+
+/* Bulk load functions */
+static inline size_t key_len(const char* const*, const size_t*, size_t);
+static bool keys_sorted(const char* const*, const size_t*, void* const*,
+			size_t);
+static inline size_t group_end(const char* const*, size_t, size_t, size_t);
+static int node_fill(Trie*, const BuildFrame*, const char* const*,
+		     const size_t*, void* const*, BuildFrame**, size_t*,
+		     size_t*);
+static int build_all(Trie*, const char* const*, const size_t*, void* const*,
+		     size_t);
+
+/* Root table functions */
+static void root_row_build(RootTable*, const TrieNode*, unsigned char);
+static void root_table_update(Trie*, const TrieNode*, unsigned char);
+static void root_table_sync(Trie*, const TrieNode*, size_t, const char*,
+			    size_t, unsigned char);
 
 /* Iterator functions */
-static bool trie_iter_step(TrieIterator**);
-static TrieIterator* trie_iter_create(const char*, TrieNode*, size_t);
+static inline TrieNode* iter_node(const TrieIterator*);
+static int iter_enter(TrieIterator*);
+static int iter_skip(TrieIterator*);
+static int iter_forward(TrieIterator*);
+static int iter_seek(TrieIterator*, const char*, size_t, bool);
+static int iter_last(TrieIterator*);
+static int iter_back(TrieIterator*);
+static bool trie_iter_step(TrieIterator**, bool);
+static TrieIterator* iter_find(Trie*, const void*, size_t, size_t, bool);
+static TrieIterator* iter_seek_alloc(Trie*, const void*, size_t, bool);
+static TrieIterator* iter_seek_create(Trie*, const void*, size_t, bool);
+static TrieIterator* iter_settle(TrieIterator*, bool);
+static TrieIterator* iter_prefix_alloc(Trie*, const void*, size_t, size_t);
+static TrieIterator* iter_alloc(const char*, size_t, TrieNode*, size_t);
+static TrieIterator* iter_clone(const TrieIterator*);
+static TrieNode** level_widen(TrieNode*, size_t, size_t*, size_t*);
+
+/* Visitor functions */
+static int visit_all(Trie*, const void*, size_t, TrieVisitor, void*, bool);
+
+/* Walker functions */
+static inline unsigned walker_state(const struct TrieWalker*);
 
 
 Trie* trie_create(const struct TrieOps ops)
+{
+	return trie_create_flags(ops, 0);
+}
+
+
+Trie* trie_create_flags(const struct TrieOps ops, unsigned flags)
 {
 	Trie* trie = NULL;
 	TrieNode* root = NULL;
-	char* empty = NULL;
 	struct TrieOps* trie_ops = NULL;
-	TrieNode* children = NULL;
+	Pool* pool = NULL;
+	RootTable* table = NULL;
 	if (!ALLOC(trie, Trie)
-	    || !ALLOC(root, TrieNode)
-	    || !VALLOC(empty, char, 1)
 	    || !ALLOC(trie_ops, struct TrieOps)
-	    || !VALLOC(children, TrieNode, 0))
+	    || !(pool = flags & TRIE_ARENA ? pool_create(POOL_CHUNK_SIZE)
+					   : pool_create_heap())
+	    || !(root = node_create(pool, "", 0, NULL)))
 		goto oom;
+	if (flags & TRIE_ROOT_TABLE) {
+		if (!(table = (RootTable*)pool_alloc(pool, sizeof *table)))
+			goto oom;
+		for (size_t i = 0; i < ROOT_TABLE_ROWS; ++i)
+			root_row_build(table, root, (unsigned char)i);
+	}
 
-	empty[0] = '\0';
-	root->segment = empty;
-	root->n_children = 0;
-	root->children = children;
-	root->value = NULL;
 	trie->max_keylen_added = 0;
+	trie->n_keys = 0;
+	trie->n_nodes = 1;
+	trie->value_bytes = 0;
+	trie->upserted = NULL;
 	trie->root = root;
+	trie->pool = pool;
+	trie->root_table = table;
+	trie->flags = flags;
 	memcpy(trie_ops, &ops, sizeof *trie_ops);
 	trie->ops = trie_ops;
 
@@ -104,10 +371,10 @@ Trie* trie_create(const struct TrieOps ops)
 
 oom:
 	free(trie);
-	free(root);
-	free(empty);
 	free(trie_ops);
-	free(children);
+	if (root)
+		pool_free(pool, root, sizeof *root);
+	pool_destroy(pool);
 	return NULL;
 }
 
@@ -117,13 +384,44 @@ void trie_destroy(Trie* trie)
 	if (!trie)
 		return;
 
-	node_recursive_free(trie->root, trie->ops->dtor);
-	free(trie->root);
+	destructor_t dtor = trie->ops->dtor;
+	if (!(trie->flags & TRIE_ARENA)) {
+		node_destroy_all(trie->pool, trie->root, dtor, true, NULL);
+		pool_free(trie->pool, trie->root, sizeof *trie->root);
+		pool_free(trie->pool, trie->root_table,
+			  sizeof *trie->root_table);
+	} else if (dtor) {
+		/* Node memory goes away with the pool */
+		node_destroy_all(trie->pool, trie->root, dtor, false,
+				 NULL);
+	}
+	pool_destroy(trie->pool);
 	free(trie->ops);
 	free(trie);
 }
 
 
+Trie* trie_build_sorted(const struct TrieOps ops, unsigned flags,
+			const char* const* keys, const size_t* lens,
+			void* const* values, size_t n)
+{
+	Trie* trie;
+	if (!keys_sorted(keys, lens, values, n)
+	    || !(trie = trie_create_flags(ops, flags)))
+		return NULL;
+
+	/* Values stay with the caller until the trie is complete */
+	destructor_t dtor = trie->ops->dtor;
+	trie->ops->dtor = NULL;
+	if (build_all(trie, keys, lens, values, n) < 0) {
+		trie_destroy(trie);
+		return NULL;
+	}
+	trie->ops->dtor = dtor;
+	return trie;
+}
+
+
 size_t trie_maxkeylen_added(Trie* trie)
 {
 	return trie->max_keylen_added;
@@ -132,77 +430,347 @@ size_t trie_maxkeylen_added(Trie* trie)
 
 int trie_insert(Trie* trie, char* key, void* val)
 {
-	char* segptr;
-	TrieNode *new_child = NULL, *node;
-	const size_t key_strlen = strlen(key);
+	return trie_insert_n(trie, key, strlen(key), val);
+}
+
 
+int trie_insert_n(Trie* trie, const void* key, size_t len, void* val)
+{
+	TrieNode* node;
+	size_t segpos, keypos;
 	if (!val)
 		return -1;
 
-	find_mismatch(trie, key, &node, NULL, &segptr, &key);
+	upsert_settle(trie);
+	find_mismatch(trie, (const char*)key, len, &node, NULL, &segpos,
+		      &keypos);
+	return insert_at(trie, (const char*)key, len, val, node, segpos,
+			 keypos);
+}
 
-	bool err;
-	if (key[0]) {
-		err = !(new_child = node_create(key, val))
-		      || node_branch(node, segptr, new_child) < 0;
-	} else {
-		err = node_split(node, segptr) < 0;
-		if (!err)
-			val_insert(node, val, trie->ops->dtor);
-	}
-	if (err) {
-		raw_node_destroy(new_child);
-		return -1;
+
+void** trie_upsert(Trie* trie, char* key, int* inserted)
+{
+	return trie_upsert_n(trie, key, strlen(key), inserted);
+}
+
+
+void** trie_upsert_n(Trie* trie, const void* key, size_t len, int* inserted)
+{
+	const char* keystr = (const char*)key;
+	TrieNode* node;
+	size_t segpos, keypos;
+	memusage_t memusage = trie->ops->memusage;
+	if (inserted)
+		*inserted = 0;
+
+	upsert_settle(trie);
+	find_mismatch(trie, keystr, len, &node, NULL, &segpos, &keypos);
+	if (keypos == len && segpos == node->seglen && node->value) {
+		/* The caller may change the value, so it is measured again at
+		 * the next change */
+		if (memusage)
+			trie->value_bytes -= memusage(node->value);
+		trie->upserted = &node->value;
+		return &node->value;
 	}
 
-	if (key_strlen > trie->max_keylen_added)
-		trie->max_keylen_added = key_strlen;
-	return 0;
+	/* The key goes in with no value, so only its count is added here */
+	if (insert_at(trie, keystr, len, NULL, node, segpos, keypos) < 0)
+		return NULL;
+	if (keypos < len)
+		node = find_child(node, (unsigned char)keystr[keypos]);
+	++trie->n_keys;
+	if (inserted)
+		*inserted = 1;
+	trie->upserted = &node->value;
+	return &node->value;
 }
 
 
 int trie_delete(Trie* trie, char* key)
+{
+	return trie_delete_n(trie, key, strlen(key));
+}
+
+
+int trie_delete_n(Trie* trie, const void* key, size_t len)
 {
 	TrieNode *node, *parent;
-	char* segptr;
-	find_mismatch(trie, key, &node, &parent, &segptr, &key);
+	size_t segpos, keypos;
+	if (trie->upserted && *trie->upserted)
+		upsert_settle(trie);
+	find_mismatch(trie, (const char*)key, len, &node, &parent, &segpos,
+		      &keypos);
+	delete_at(trie, (const char*)key, len, node, parent, segpos, keypos);
+	trie->upserted = NULL;
+	return 0;
+}
 
-	if (*key || *segptr)
-		/* Not found */
-		return 0;
 
-	destructor_t dtor = trie->ops->dtor;
+size_t trie_delete_prefix(Trie* trie, const char* key_prefix)
+{
+	return trie_delete_prefix_n(trie, key_prefix, strlen(key_prefix));
+}
 
-	if (node->n_children > 1 || !parent) {
-		val_insert(node, NULL, dtor);
+
+size_t trie_delete_prefix_n(Trie* trie, const void* key_prefix, size_t len)
+{
+	const char* prefix = (const char*)key_prefix;
+	TrieNode *node, *parent;
+	size_t segpos, keypos, n_keys = trie->n_keys;
+	Pool* pool = trie->pool;
+	destructor_t dtor = trie->ops->dtor;
+	upsert_settle(trie);
+	find_mismatch(trie, prefix, len, &node, &parent, &segpos, &keypos);
+	if (keypos < len)
 		return 0;
+
+	/* Every key below node starts with the prefix, so the whole subtree
+	 * goes, leaving node as an empty leaf */
+	node_destroy_all(pool, node, dtor, true, trie);
+	node->children = NULL;
+	node->n_children = node->capacity = 0;
+	if (!parent) {
+		++trie->n_nodes;
+		root_table_update(trie, node, 0);
+		return n_keys - trie->n_keys;
 	}
 
-	if (node->n_children == 1)
-		return node_merge(node, dtor);
+	node_delchild(pool, parent, node, dtor);
+	if (!parent->value && parent->n_children == 1 && parent != trie->root
+	    && node_merge(pool, parent, dtor) == 0)
+		--trie->n_nodes;
+	root_table_update(trie, parent, (unsigned char)prefix[0]);
+	return n_keys - trie->n_keys;
+}
+
+
+int trie_move_prefix(Trie* trie, const char* from, const char* to)
+{
+	return trie_move_prefix_n(trie, from, strlen(from), to, strlen(to));
+}
 
-	if (node_delchild(parent, node, dtor) < 0)
+
+int trie_move_prefix_n(Trie* trie, const void* from, size_t from_len,
+		       const void* to, size_t to_len)
+{
+	const char *fromstr = (const char*)from, *tostr = (const char*)to;
+	TrieNode *node, *parent, *dst, moved, *root = trie->root;
+	size_t segpos, keypos, pos;
+	Pool* pool = trie->pool;
+	GraftStack stack;
+	upsert_settle(trie);
+	if (from_len == to_len && memcmp(fromstr, tostr, to_len) == 0)
+		return 0;
+	find_mismatch(trie, fromstr, from_len, &node, &parent, &segpos,
+		      &keypos);
+	if (keypos < from_len || (!parent && !root->value && !root->n_children))
+		return 0;
+	if (!parent)
+		return move_all(trie, tostr, to_len);
+
+	/* The subtree goes back in under the new prefix followed by the rest
+	 * of the segment of node. Whatever takes memory is done while the
+	 * subtree is still in place, so that running out moves no key. */
+	size_t tail = node->seglen - segpos, start = from_len - segpos;
+	size_t len = to_len + tail;
+	char* key = add_strs(NULL, tostr, to_len, node_seg(node) + segpos,
+			     tail);
+	if (!key)
 		return -1;
+	TrieNode* children = root->children;
+	size_t n_children = root->n_children;
+	graft_init(&stack);
+	int rc = (dst = graft_path(trie, key, len, &node, &pos)) ? 0 : -1;
+	if (rc == 0 && pos == len)
+		rc = graft_prepare(trie, trie, &stack, dst, node, &node);
+	if (rc == 0)
+		rc = node_init(pool, &moved, key + pos, len - pos, NULL);
+	root_table_sync(trie, children, n_children, key, len, fromstr[0]);
+	if (rc < 0) {
+		graft_release(&stack);
+		free(key);
+		return -1;
+	}
+
+	find_mismatch(trie, fromstr, from_len, &node, &parent, &segpos,
+		      &keypos);
+	moved.value = node->value;
+	moved.children = node->children;
+	moved.n_children = node->n_children;
+	moved.capacity = node->capacity;
+	seg_free(pool, node);
+	children = root->children;
+	n_children = root->n_children;
+	children_remove(parent, node);
+	root_table_sync(trie, children, n_children, key, len, fromstr[0]);
+
+	find_mismatch(trie, key, pos, &dst, NULL, &segpos, &keypos);
+	children = root->children;
+	n_children = root->n_children;
+	if (pos < len)
+		children_insert(dst, &moved);
+	else
+		node_graft(trie, &stack, dst, &moved, NULL);
+	root_table_sync(trie, children, n_children, key, len, fromstr[0]);
+
+	/* The node the subtree left is merged with its only child if it holds
+	 * nothing else */
+	find_mismatch(trie, fromstr, start, &parent, NULL, &segpos, &keypos);
+	if (keypos == start && segpos == parent->seglen && parent != root
+	    && !parent->value && parent->n_children == 1
+	    && node_merge(pool, parent, trie->ops->dtor) == 0) {
+		--trie->n_nodes;
+		root_table_update(trie, parent, (unsigned char)fromstr[0]);
+	}
+
+	graft_release(&stack);
+	free(key);
+	if (to_len > from_len)
+		trie->max_keylen_added += to_len - from_len;
+	return 0;
+}
+
 
-	if (!parent->value && parent->n_children == 1 && parent != trie->root)
-		return node_merge(parent, dtor);
+int trie_merge(Trie* dst, Trie* src, TrieResolver resolve)
+{
+	TrieNode *root = src->root, moved, *skip = NULL;
+	size_t kept = sizeof *root
+		      + (src->root_table ? sizeof *src->root_table : 0);
+	GraftStack stack;
+	upsert_settle(dst);
+	upsert_settle(src);
+	if (dst == src || (!root->value && !root->n_children))
+		return 0;
 
+	/* Both tries are split where they part before anything moves, so
+	 * that running out of memory loses no key */
+	graft_init(&stack);
+	int rc = graft_prepare(dst, src, &stack, dst->root, root, &skip);
+
+	/* Nodes allocated from the heap change hands as they are, while nodes
+	 * living in the chunks of an arena are copied */
+	moved = *root;
+	if (rc == 0
+	    && pool_adopt(dst->pool, src->pool, pool_in_use(src->pool) - kept)
+	       < 0) {
+		rc = node_clone(dst->pool, &moved);
+		if (rc == 0)
+			node_destroy_all(src->pool, root, NULL, true, NULL);
+	}
+	if (rc < 0) {
+		graft_release(&stack);
+		root_table_update(dst, dst->root, 0);
+		root_table_update(src, root, 0);
+		return -1;
+	}
+	root->value = NULL;
+	root->children = NULL;
+	root->n_children = root->capacity = 0;
+
+	dst->n_keys += src->n_keys;
+	dst->n_nodes += src->n_nodes;
+	dst->value_bytes += src->value_bytes;
+	if (src->max_keylen_added > dst->max_keylen_added)
+		dst->max_keylen_added = src->max_keylen_added;
+	src->n_keys = src->value_bytes = 0;
+	src->n_nodes = 1;
+	root_table_update(src, root, 0);
+
+	node_graft(dst, &stack, dst->root, &moved, resolve);
+	graft_release(&stack);
+	root_table_update(dst, dst->root, 0);
 	return 0;
 }
 
 
 void* trie_find(Trie* trie, char* key)
+{
+	return trie_find_n(trie, key, strlen(key));
+}
+
+
+void* trie_find_n(Trie* trie, const void* key, size_t len)
 {
 	TrieNode* node;
-	char* segptr;
-	find_mismatch(trie, key, &node, NULL, &segptr, &key);
-	return *key || *segptr ? NULL : node->value;
+	size_t segpos, keypos;
+	find_mismatch(trie, (const char*)key, len, &node, NULL, &segpos,
+		      &keypos);
+	return keypos < len || segpos < node->seglen ? NULL : node->value;
+}
+
+
+size_t trie_find_batch(Trie* trie, const char* const* keys, const size_t* lens,
+		       size_t n, void** values)
+{
+	FindLane lanes[FIND_BATCH_WIDTH];
+	size_t n_lanes = 0, next = 0, n_found = 0;
+	while (next < n || n_lanes) {
+		for (; n_lanes < FIND_BATCH_WIDTH && next < n; ++next)
+			find_lane_start(trie, &lanes[n_lanes++], keys[next],
+					lens ? lens[next] : strlen(keys[next]),
+					next);
+		for (size_t i = 0; i < n_lanes;) {
+			if (find_lane_step(&lanes[i])) {
+				++i;
+				continue;
+			}
+			const TrieNode* node = lanes[i].node;
+			void* value = node ? node->value : NULL;
+			values[lanes[i].index] = value;
+			n_found += value != NULL;
+			lanes[i] = lanes[--n_lanes];
+		}
+	}
+	return n_found;
+}
+
+
+size_t trie_apply_batch(Trie* trie, struct TrieBatchOp* ops, size_t n)
+{
+	BatchKey* order = NULL;
+	BatchRange* ranges = NULL;
+	upsert_settle(trie);
+	if (n && VALLOC(order, BatchKey, 2 * n)
+	    && (batch_sorted(ops, order, n)
+		|| VALLOC(ranges, BatchRange, n / 2 + 1))) {
+		if (ranges)
+			batch_sort(ops, order, order + n, ranges, n);
+		batch_apply(trie, ops, order, n);
+	} else {
+		/* Without room to sort, ops are applied one by one */
+		for (size_t i = 0; i < n; ++i)
+			ops[i].result = ops[i].kind == TRIE_BATCH_INSERT
+				? trie_insert_n(trie, ops[i].key, ops[i].len,
+						ops[i].value)
+				: trie_delete_n(trie, ops[i].key, ops[i].len);
+	}
+	free(order);
+	free(ranges);
+
+	size_t n_failed = 0;
+	for (size_t i = 0; i < n; ++i)
+		n_failed += ops[i].result != 0;
+	return n_failed;
 }
 
 
 size_t trie_memory_usage(const Trie* trie)
 {
-	return trie ? node_memory_usage(trie->root, trie->ops->memusage) : 0;
+	return trie ? pool_in_use(trie->pool) + trie->value_bytes
+		    + upsert_pending(trie) : 0;
+}
+
+
+struct TrieStats trie_stats(const Trie* trie)
+{
+	struct TrieStats stats;
+	stats.n_keys = trie->n_keys;
+	stats.n_nodes = trie->n_nodes;
+	stats.node_bytes = pool_in_use(trie->pool);
+	stats.value_bytes = trie->value_bytes + upsert_pending(trie);
+	return stats;
 }
 
 
@@ -211,8 +779,7 @@ void trie_iter_destroy(TrieIterator* iter)
 	if (!iter)
 		return;
 
-	stack_destroy(iter->node_stack);
-	stack_destroy(iter->keyptr_stack);
+	walk_release(&iter->walk);
 	free(iter->key);
 	free(iter);
 }
@@ -221,340 +788,1972 @@ void trie_iter_destroy(TrieIterator* iter)
 TrieIterator* trie_findall(Trie* trie, const char* key_prefix,
 			   size_t max_keylen)
 {
-	TrieNode* node;
-	char *segptr, *prefix_left;
-	find_mismatch(trie, key_prefix, &node, NULL, &segptr, &prefix_left);
-
-	if (*prefix_left)
-		/* Full prefix not found */
-		return NULL;
+	return trie_findall_n(trie, key_prefix, strlen(key_prefix),
+			      max_keylen);
+}
 
-	char* trunc_prefix = add_strs(key_prefix, segptr);
-	if (!trunc_prefix)
-		return NULL;
 
-	TrieIterator* iter = trie_iter_create(trunc_prefix, node, max_keylen);
-	free(trunc_prefix);
-	return iter;
+TrieIterator* trie_findall_n(Trie* trie, const void* key_prefix, size_t len,
+			     size_t max_keylen)
+{
+	return iter_find(trie, key_prefix, len, max_keylen, false);
 }
 
 
-void trie_iter_next(TrieIterator** iter_p)
+TrieIterator* trie_findlast(Trie* trie, const char* key_prefix,
+			    size_t max_keylen)
 {
-	while (!trie_iter_step(iter_p));
+	return trie_findlast_n(trie, key_prefix, strlen(key_prefix),
+			       max_keylen);
 }
 
 
-const char* trie_iter_getkey(const TrieIterator* iter)
+TrieIterator* trie_findlast_n(Trie* trie, const void* key_prefix, size_t len,
+			      size_t max_keylen)
 {
-	return iter ? iter->key : NULL;
+	return iter_find(trie, key_prefix, len, max_keylen, true);
 }
 
 
-void* trie_iter_getval(const TrieIterator* iter)
+TrieIterator* trie_seek(Trie* trie, const char* key)
 {
-	return iter ? iter->value : NULL;
+	return iter_seek_create(trie, key, strlen(key), false);
 }
 
 
-static void node_recursive_free(TrieNode* node, destructor_t dtor)
+TrieIterator* trie_seek_n(Trie* trie, const void* key, size_t len)
 {
-	size_t n_children = node->n_children;
-	TrieNode* children = node->children;
-	for (size_t i = 0; i < n_children; ++i)
-		node_recursive_free(&children[i], dtor);
-	free(children);
+	return iter_seek_create(trie, key, len, false);
+}
 
-	free(node->segment);
-	if (dtor)
-		dtor(node->value);
+
+TrieIterator* trie_upper_bound(Trie* trie, const char* key)
+{
+	return iter_seek_create(trie, key, strlen(key), true);
 }
 
 
-static void raw_node_destroy(TrieNode* node)
+TrieIterator* trie_upper_bound_n(Trie* trie, const void* key, size_t len)
 {
-	if (!node)
-		return;
-	free(node->segment);
-	free(node->children);
-	free(node);
+	return iter_seek_create(trie, key, len, true);
 }
 
 
-static char* str_dup(const char* str)
+TrieIterator* trie_range(Trie* trie, const char* lo, const char* hi)
 {
-	size_t len = strlen(str);
-	char* result;
-	if (VALLOC(result, char, len + 1))
-		memcpy(result, str, len + 1);
-	return result;
+	return trie_range_n(trie, lo, strlen(lo), hi, strlen(hi));
 }
 
 
-static TrieNode* node_create(char* segment, void* value)
+TrieIterator* trie_range_n(Trie* trie, const void* lo, size_t lo_len,
+			   const void* hi, size_t hi_len)
 {
-	char* seg = NULL;
-	TrieNode *node = NULL, *children = NULL;
-	if (!ALLOC(node, TrieNode)
-	    || !(seg = str_dup(segment))
-	    || !VALLOC(children, TrieNode, 0))
-		goto oom;
+	const char *lostr = (const char*)lo, *histr = (const char*)hi;
+	size_t len = lo_len < hi_len ? lo_len : hi_len;
+	size_t common = pflen(lostr, histr, len);
+	if (common == len ? lo_len >= hi_len
+			  : (unsigned char)lostr[common]
+			    > (unsigned char)histr[common])
+		/* Empty range */
+		return NULL;
 
-	node->segment = seg;
-	node->n_children = 0;
-	node->children = children;
-	node->value = value;
-	return node;
+	/* Every node from the first one not less than hi onwards follows the
+	 * range in preorder, so reaching that node ends the iteration */
+	TrieIterator *iter, *end;
+	if (!(end = iter_alloc("", 0, trie->root, TRIE_KEYLEN_ANY)))
+		return NULL;
+	int found = iter_seek(end, histr, hi_len, false);
+	TrieNode* end_node = found > 0 ? iter_node(end) : NULL;
+	trie_iter_destroy(end);
 
-oom:
-	free(node);
-	free(seg);
-	free(children);
-	return NULL;
+	if (found < 0 || !(iter = iter_seek_alloc(trie, lo, lo_len, false)))
+		return NULL;
+	iter->first = iter_node(iter);
+	iter->end = end_node;
+	return iter_settle(iter, true);
 }
 
 
-static char* str_n_dup(const char* str, size_t n)
+int trie_foreach(Trie* trie, const char* key_prefix, TrieVisitor visitor,
+		 void* ctx)
 {
-	size_t len = strlen(str), min = len < n ? len : n;
-	char* result;
-	if (VALLOC(result, char, min + 1)) {
-		memcpy(result, str, min);
-		result[min] = '\0';
-	}
-	return result;
+	return visit_all(trie, key_prefix, strlen(key_prefix), visitor, ctx,
+			 true);
 }
 
 
-static int node_split(TrieNode* node, char* at)
+int trie_foreach_n(Trie* trie, const void* key_prefix, size_t len,
+		   TrieVisitor visitor, void* ctx)
 {
-	if (!at[0])
-		return 0;
-
-	char* segment = NULL;
-	TrieNode* child = NULL;
-	size_t parent_seglen = (size_t)(at - node->segment);
-
-	if (!(segment = str_n_dup(node->segment, parent_seglen))
-	    || !(child = node_create(at, node->value)))
-		goto oom;
-
-	child->n_children = node->n_children;
-	free(child->children);
-	child->children = node->children;
+	return visit_all(trie, key_prefix, len, visitor, ctx, true);
+}
 
-	free(node->segment);
-	node->segment = segment;
-	node->n_children = 1;
-	node->children = &child[0];
-	node->value = NULL;
-	return 0;
 
-oom:
-	free(segment);
-	raw_node_destroy(child);
-	return -1;
+int trie_foreach_value(Trie* trie, const char* key_prefix,
+		       TrieVisitor visitor, void* ctx)
+{
+	return visit_all(trie, key_prefix, strlen(key_prefix), visitor, ctx,
+			 false);
 }
 
 
-static char* add_strs(const char* str1, const char* str2)
+int trie_foreach_value_n(Trie* trie, const void* key_prefix, size_t len,
+			 TrieVisitor visitor, void* ctx)
 {
-	size_t len1 = strlen(str1), len2 = strlen(str2);
-	char* result;
-	if (!VALLOC(result, char, len1 + len2 + 1))
-		return NULL;
-	strcpy(result, str1);
-	strcpy(result + len1, str2);
-	return result;
+	return visit_all(trie, key_prefix, len, visitor, ctx, false);
 }
 
 
-static void val_insert(TrieNode* node, void* val, destructor_t dtor)
+size_t trie_split(Trie* trie, const char* key_prefix, TrieIterator** iters,
+		  size_t n)
 {
-	if (node->value && dtor)
-		dtor(node->value);
-	node->value = val;
+	return trie_split_n(trie, key_prefix, strlen(key_prefix), iters, n);
 }
 
 
-static int node_merge(TrieNode* node, destructor_t dtor)
+size_t trie_split_n(Trie* trie, const void* key_prefix, size_t len,
+		    TrieIterator** iters, size_t n)
 {
-	if (node->n_children != 1)
+	TrieIterator* cursor;
+	TrieNode** level = NULL;
+	size_t depth, n_level, n_pieces, n_iters = 0, k = 0;
+
+	if (!n || !(cursor = iter_prefix_alloc(trie, key_prefix, len,
+					       TRIE_KEYLEN_ANY)))
 		return 0;
-	TrieNode* child = node->children;
+	if (!(level = level_widen(cursor->start, n * SPLIT_LEVEL_NODES,
+				  &n_level, &depth)))
+		goto oom;
 
-	char* new_segment = NULL;
-	if (!(new_segment = add_strs(node->segment, child->segment)))
+	/* Piece k runs in preorder from the node at k * n_level / n_pieces in
+	 * the level up to the first node of the next piece. The first piece
+	 * also covers the nodes above the level. */
+	n_pieces = n < n_level ? n : n_level;
+	if (!(iters[k++] = iter_clone(cursor)))
 		goto oom;
-	free(node->segment);
-	free(child->segment);
+	while (k < n_pieces) {
+		int moved = cursor->walk.depth < depth ? iter_forward(cursor)
+						       : iter_skip(cursor);
+		if (moved <= 0)
+			goto oom;
+		if (cursor->walk.depth == depth
+		    && iter_node(cursor) == level[k * n_level / n_pieces]
+		    && !(iters[k++] = iter_clone(cursor)))
+			goto oom;
+	}
+	trie_iter_destroy(cursor);
+	free(level);
 
-	node->segment = new_segment;
-	node->n_children = child->n_children;
-	node->children = child->children;
-	val_insert(node, child->value, dtor);
+	for (k = 0; k < n_pieces; ++k) {
+		iters[k]->first = iter_node(iters[k]);
+		if (k + 1 < n_pieces)
+			iters[k]->end = iter_node(iters[k + 1]);
+	}
+	for (k = 0; k < n_pieces; ++k)
+		if ((iters[n_iters] = iter_settle(iters[k], true)))
+			++n_iters;
+	return n_iters;
 
-	free(child);
+oom:
+	while (k-- > 0)
+		trie_iter_destroy(iters[k]);
+	trie_iter_destroy(cursor);
+	free(level);
 	return 0;
+}
 
-oom:
-	free(new_segment);
-	return -1;
+
+void trie_iter_next(TrieIterator** iter_p)
+{
+	while (!trie_iter_step(iter_p, true));
 }
 
 
-static inline TrieNode* leq_child(TrieNode* node, char find)
+void trie_iter_prev(TrieIterator** iter_p)
 {
-	if (node->n_children == 0 || find < node->children[0].segment[0])
-		return NULL;
+	while (!trie_iter_step(iter_p, false));
+}
 
-	size_t s = 0, e = node->n_children;
-	while (e - s > 1) {
-		size_t m = (s + e) / 2;
-		if (node->children[m].segment[0] <= find)
-			s = m;
-		else
-			e = m;
-	}
-	return &node->children[s];
+
+const char* trie_iter_getkey(const TrieIterator* iter)
+{
+	return iter ? iter->key : NULL;
 }
 
 
-static inline ptrdiff_t pflen_equal(const char* of, const char* with)
+size_t trie_iter_getkeylen(const TrieIterator* iter)
 {
-	const char* of_old = of;
-	while (*of++ == *with++ && of[-1]);
-	return (of - 1) - of_old;
+	return iter ? iter->keylen : 0;
 }
 
 
-static void find_mismatch(Trie* trie, const char* key, TrieNode** node_p,
-			  TrieNode** parent_p, char** seg_p, char** key_p)
+void* trie_iter_getval(const TrieIterator* iter)
 {
-	TrieNode *node = trie->root, *parent = NULL;
-	char* seg = trie->root->segment;
+	return iter ? iter->value : NULL;
+}
 
-	while (key[0] && !seg[0]) {
-		TrieNode* child = leq_child(node, key[0]);
-		if (!child || child->segment[0] != key[0])
-			break;
-		parent = node, node = child, seg = child->segment;
-		ptrdiff_t pflen = pflen_equal(key, seg);
-		key += pflen, seg += pflen;
+
+/* Destroys the values and memory of all nodes below root, and the value and
+ * segment of root itself, without recursing or allocating. Nodes waiting to
+ * be visited are linked through their value slots once their values are
+ * destroyed, and the first node of each child vector keeps the capacity of
+ * the vector in its segment length so the vector can be released when that
+ * node is visited. The destroyed nodes and values, root included, are taken
+ * off the counters of uncount unless it is NULL. */
+static void node_destroy_all(Pool* pool, TrieNode* root, destructor_t dtor,
+			     bool release, Trie* uncount)
+{
+	if (uncount) {
+		val_count(uncount, root->value, NULL);
+		--uncount->n_nodes;
 	}
+	if (dtor)
+		dtor(root->value);
+	if (release)
+		seg_free(pool, root);
+	root->value = NULL;
+	root->seglen = 0;
+
+	TrieNode* node = root;
+	while (node) {
+		TrieNode* children = node->children;
+		TrieNode* next = (TrieNode*)node->value;
+		size_t n_children = node->n_children, capacity = node->seglen;
+
+		for (size_t i = 0; i < n_children; ++i) {
+			TrieNode* child = &children[i];
+			if (uncount) {
+				val_count(uncount, child->value, NULL);
+				--uncount->n_nodes;
+			}
+			if (dtor)
+				dtor(child->value);
+			if (release)
+				seg_free(pool, child);
+			child->value = next;
+			child->seglen = 0;
+			next = child;
+		}
+		if (n_children)
+			children[0].seglen = node->capacity;
+		else if (release)
+			pool_free(pool, children,
+				  children_size(node->capacity));
+
+		/* The first node of a vector is visited after its siblings */
+		if (release && capacity)
+			pool_free(pool, node, children_size(capacity));
+		node = next;
+	}
+}
 
-	*node_p = node;
-	if (parent_p)
-		*parent_p = parent;
-	*seg_p = seg;
-	*key_p = (char*)key;
+
+static void raw_node_destroy(Pool* pool, TrieNode* node)
+{
+	if (!node)
+		return;
+	seg_free(pool, node);
+	pool_free(pool, node->children, children_size(node->capacity));
+	pool_free(pool, node, sizeof *node);
 }
 
 
-static int node_fork(TrieNode* node, char* at, TrieNode* new_child)
+static inline char* node_seg(const TrieNode* node)
 {
-	TrieNode *new_children = NULL, *split_child;
+	return node->seglen < SEG_LOCAL_SIZE ? (char*)node->seg.local
+					     : node->seg.heap;
+}
 
-	if (!VALLOC(new_children, TrieNode, 2) || node_split(node, at) < 0)
-		goto oom;
 
-	split_child = &node->children[0];
+static int node_setseg(Pool* pool, TrieNode* node, const char* str,
+		       size_t len)
+{
+	char* heap = NULL;
+	if (len >= SEG_LOCAL_SIZE) {
+		if (!(heap = (char*)pool_alloc(pool, len + 1)))
+			return -1;
+		memcpy(heap, str, len);
+		heap[len] = '\0';
+	}
 
-	if (split_child->segment[0] < new_child->segment[0]) {
-		new_children[0] = *split_child;
-		new_children[1] = *new_child;
+	/* str may point into the current segment */
+	char* old_heap = node->seglen < SEG_LOCAL_SIZE ? NULL : node->seg.heap;
+	size_t old_len = node->seglen;
+	if (heap) {
+		node->seg.heap = heap;
 	} else {
-		new_children[0] = *new_child;
-		new_children[1] = *split_child;
+		memmove(node->seg.local, str, len);
+		node->seg.local[len] = '\0';
 	}
-	node->children = new_children;
-	node->n_children = 2;
-
-	free(split_child);
-	free(new_child);
+	node->seglen = len;
+	pool_free(pool, old_heap, old_len + 1);
 	return 0;
-
-oom:
-	free(new_children);
-	return -1;
 }
 
 
-static int node_addchild(TrieNode* node, TrieNode* new_child)
+static inline void seg_free(Pool* pool, TrieNode* node)
 {
-	char find = new_child->segment[0];
-	ptrdiff_t ins;
-	size_t n_children = node->n_children, sz1, sz2;
-	TrieNode *children = node->children, *new_children = NULL, *leq;
+	if (node->seglen >= SEG_LOCAL_SIZE)
+		pool_free(pool, node->seg.heap, node->seglen + 1);
+}
 
-	if (!VALLOC(new_children, TrieNode, n_children + 1))
-		goto oom;
 
-	leq = leq_child(node, find);
-	ins = leq ? (leq - children) + 1 : 0;
-	sz1 = ins * sizeof children[0];
-	sz2 = (n_children - ins) * sizeof children[0];
+static int node_init(Pool* pool, TrieNode* node, const char* segment,
+		     size_t seglen, void* value)
+{
+	node->seglen = 0;
+	if (node_setseg(pool, node, segment, seglen) < 0)
+		return -1;
+	node->n_children = 0;
+	node->capacity = 0;
+	node->children = NULL;
+	node->value = value;
+	return 0;
+}
 
-	memcpy(new_children, children, sz1);
-	new_children[ins] = *new_child;
-	memcpy(&new_children[ins + 1], &children[ins], sz2);
-	node->children = new_children;
-	++node->n_children;
 
-	free(children);
-	free(new_child);
-	return 0;
+static TrieNode* node_create(Pool* pool, const char* segment, size_t seglen,
+			     void* value)
+{
+	TrieNode* node = NULL;
+	if (!(node = (TrieNode*)pool_alloc(pool, sizeof *node)))
+		return NULL;
 
-oom:
-	free(new_children);
-	return -1;
+	if (node_init(pool, node, segment, seglen, value) < 0) {
+		pool_free(pool, node, sizeof *node);
+		return NULL;
+	}
+	return node;
 }
 
 
-static int node_branch(TrieNode* node, char* at, TrieNode* child)
+static inline size_t children_size(size_t capacity)
 {
-	return at[0] ? node_fork(node, at, child) : node_addchild(node, child);
+	size_t index_size = capacity > NODE16_MAX ? NODE_INDEX_SIZE : 0;
+	return capacity * (sizeof(TrieNode) + 1) + index_size;
 }
 
 
-static int node_delchild(TrieNode* node, TrieNode* child,
-			 destructor_t dtor)
+static inline unsigned char* node_keys(const TrieNode* node)
 {
-	ptrdiff_t del;
-	size_t n_children = node->n_children, sz1, sz2;
-	TrieNode *new_children, *children = node->children;
-	char* child_segment = child->segment;
-	TrieNode* child_children = child->children;
-	void* child_value = child->value;
+	return (unsigned char*)(node->children + node->capacity);
+}
 
-	if (!VALLOC(new_children, TrieNode, n_children - 1))
+
+static inline unsigned char* node_index(const TrieNode* node)
+{
+	return node_keys(node) + node->capacity;
+}
+
+
+static inline unsigned char node_byte(const TrieNode* node)
+{
+	return (unsigned char)node_seg(node)[0];
+}
+
+
+static void children_reindex(TrieNode* node, size_t gap)
+{
+	if (node->capacity <= NODE16_MAX)
+		return;
+
+	unsigned char *keys = node_keys(node), *index = node_index(node);
+	size_t n_slots = node->n_children + (gap <= node->n_children);
+	memset(index, 0, NODE_INDEX_SIZE);
+	for (size_t i = 0; i < n_slots; ++i)
+		if (i != gap)
+			index[keys[i]] = (unsigned char)i;
+}
+
+
+/* Move the children of a node into a new vector, leaving a gap at slot gap
+ * unless gap is out of range. */
+static int children_resize(Pool* pool, TrieNode* node, size_t capacity,
+			   size_t gap)
+{
+	TrieNode *children = node->children, *new_children;
+	unsigned char *keys = node_keys(node), *new_keys;
+	size_t n_children = node->n_children, old_capacity = node->capacity;
+	size_t n_before = gap < n_children ? gap : n_children;
+	size_t n_after = n_children - n_before, shift = gap <= n_children;
+
+	new_children = (TrieNode*)pool_alloc(pool, children_size(capacity));
+	if (!new_children)
+		return -1;
+	new_keys = (unsigned char*)(new_children + capacity);
+
+	if (n_children) {
+		memcpy(new_children, children, n_before * sizeof children[0]);
+		memcpy(&new_children[n_before + shift], &children[n_before],
+		       n_after * sizeof children[0]);
+		memcpy(new_keys, keys, n_before);
+		memcpy(&new_keys[n_before + shift], &keys[n_before], n_after);
+	}
+	node->children = new_children;
+	node->capacity = (unsigned short)capacity;
+	children_reindex(node, gap);
+
+	pool_free(pool, children, children_size(old_capacity));
+	return 0;
+}
+
+
+static int node_split(Pool* pool, TrieNode* node, size_t parent_seglen)
+{
+	if (parent_seglen == node->seglen)
+		return 0;
+
+	TrieNode* child = NULL;
+	const char* at = node_seg(node) + parent_seglen;
+
+	if (!(child = (TrieNode*)pool_alloc(pool, children_size(1))))
+		return -1;
+	if (node_init(pool, child, at, node->seglen - parent_seglen,
+		      node->value) < 0)
+		goto oom;
+	if (node_setseg(pool, node, node_seg(node), parent_seglen) < 0) {
+		seg_free(pool, child);
+		goto oom;
+	}
+
+	child->n_children = node->n_children;
+	child->capacity = node->capacity;
+	child->children = node->children;
+
+	node->n_children = 1;
+	node->capacity = 1;
+	node->children = &child[0];
+	node_keys(node)[0] = node_byte(child);
+	node->value = NULL;
+	return 0;
+
+oom:
+	pool_free(pool, child, children_size(1));
+	return -1;
+}
+
+
+static char* add_strs(Pool* pool, const char* str1, size_t len1,
+		      const char* str2, size_t len2)
+{
+	char* result;
+	if (!(result = (char*)pool_alloc(pool, len1 + len2 + 1)))
+		return NULL;
+	memcpy(result, str1, len1);
+	memcpy(result + len1, str2, len2);
+	result[len1 + len2] = '\0';
+	return result;
+}
+
+
+static void val_count(Trie* trie, void* old_val, void* new_val)
+{
+	memusage_t memusage = trie->ops->memusage;
+	if (old_val) {
+		--trie->n_keys;
+		if (memusage)
+			trie->value_bytes -= memusage(old_val);
+	}
+	if (new_val) {
+		++trie->n_keys;
+		if (memusage)
+			trie->value_bytes += memusage(new_val);
+	}
+}
+
+
+static size_t upsert_pending(const Trie* trie)
+{
+	memusage_t memusage = trie->ops->memusage;
+	void** slot = trie->upserted;
+	return memusage && slot && *slot ? memusage(*slot) : 0;
+}
+
+
+static void upsert_settle(Trie* trie)
+{
+	trie->value_bytes += upsert_pending(trie);
+	trie->upserted = NULL;
+}
+
+
+static void val_insert(TrieNode* node, void* val, destructor_t dtor)
+{
+	if (node->value && dtor)
+		dtor(node->value);
+	node->value = val;
+}
+
+
+static int node_merge(Pool* pool, TrieNode* node, destructor_t dtor)
+{
+	if (node->n_children != 1)
+		return 0;
+	TrieNode* child = node->children;
+
+	size_t seglen = node->seglen + child->seglen;
+	char *heap = NULL, *seg;
+	if (seglen >= SEG_LOCAL_SIZE) {
+		if (!(heap = (char*)pool_alloc(pool, seglen + 1)))
+			return -1;
+		memcpy(heap, node_seg(node), node->seglen);
+	}
+	seg = heap ? heap : node->seg.local;
+	memcpy(seg + node->seglen, node_seg(child), child->seglen + 1);
+	if (heap) {
+		seg_free(pool, node);
+		node->seg.heap = heap;
+	}
+	node->seglen = seglen;
+	seg_free(pool, child);
+
+	size_t capacity = node->capacity;
+	node->n_children = child->n_children;
+	node->capacity = child->capacity;
+	node->children = child->children;
+	val_insert(node, child->value, dtor);
+
+	pool_free(pool, child, children_size(capacity));
+	return 0;
+}
+
+
+static FORCE_INLINE size_t keys_scan(const unsigned char* keys, size_t n_keys,
+				     unsigned char find)
+{
+#ifdef TRIE_SSE2
+	/* Keys follow at least 16 bytes of children in the same vector, so the
+	 * load ends at the last key instead of running past the vector */
+	__m128i block = _mm_loadu_si128((const __m128i*)(keys + n_keys - 16));
+	__m128i eq = _mm_cmpeq_epi8(block, _mm_set1_epi8((char)find));
+	unsigned mask = (unsigned)_mm_movemask_epi8(eq) >> (16 - n_keys);
+	return mask ? (size_t)__builtin_ctz(mask) : n_keys;
+#else
+	size_t s = 0, e = n_keys;
+	if (n_keys > NODE4_MAX) {
+		while (e - s > 1) {
+			size_t m = (s + e) / 2;
+			if (keys[m] <= find)
+				s = m;
+			else
+				e = m;
+		}
+	} else {
+		while (s < n_keys && keys[s] < find)
+			++s;
+	}
+	return s < n_keys && keys[s] == find ? s : n_keys;
+#endif
+}
+
+
+static FORCE_INLINE TrieNode* find_child(const TrieNode* node,
+					unsigned char find)
+{
+	size_t n_children = node->n_children, s;
+	const unsigned char* keys = node_keys(node);
+
+	if (n_children > NODE16_MAX) {
+		s = node_index(node)[find];
+		return keys[s] == find ? &node->children[s] : NULL;
+	}
+	if (n_children == 0)
+		return NULL;
+	s = keys_scan(keys, n_children, find);
+	return s < n_children ? &node->children[s] : NULL;
+}
+
+
+static inline size_t child_rank(const TrieNode* node, unsigned char find)
+{
+	const unsigned char* keys = node_keys(node);
+	size_t s = 0, e = node->n_children;
+	while (s < e) {
+		size_t m = (s + e) / 2;
+		if (keys[m] < find)
+			s = m + 1;
+		else
+			e = m;
+	}
+	return s;
+}
+
+
+static FORCE_INLINE size_t pflen(const char* of, const char* with, size_t n)
+{
+	/* Both lengths are known, so no load reaches past the shorter one */
+	size_t len = 0;
+#ifdef TRIE_SSE2
+	for (; n - len >= 16; len += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(of + len));
+		__m128i b = _mm_loadu_si128((const __m128i*)(with + len));
+		unsigned eq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+		if (eq != 0xFFFF)
+			return len + (size_t)__builtin_ctz(~eq);
+	}
+#endif
+#ifdef TRIE_WORD_CMP
+	for (; n - len >= 8; len += 8) {
+		unsigned long long a, b;
+		memcpy(&a, of + len, 8);
+		memcpy(&b, with + len, 8);
+		if (a != b)
+			return len + (size_t)__builtin_ctzll(a ^ b) / 8;
+	}
+#endif
+	while (len < n && of[len] == with[len])
+		++len;
+	return len;
+}
+
+
+static inline size_t seg_match(const TrieNode* node, const char* key,
+				size_t left)
+{
+	return pflen(key, node_seg(node),
+		     left < node->seglen ? left : node->seglen);
+}
+
+
+static void find_mismatch(Trie* trie, const char* key, size_t keylen,
+			  TrieNode** node_p, TrieNode** parent_p,
+			  size_t* segpos_p, size_t* keypos_p)
+{
+	TrieNode *node = trie->root, *parent = NULL;
+	size_t segpos = node->seglen, keypos = 0;
+	RootTable* table = trie->root_table;
+
+	if (table && keylen >= 2) {
+		unsigned char first = (unsigned char)key[0];
+		TrieNode* next = table->nodes[(size_t)first << 8
+					      | (unsigned char)key[1]];
+		if (next) {
+			parent = table->rows[first];
+			if (next == parent)
+				parent = node;
+			else
+				keypos = 1;
+			node = next;
+			segpos = seg_match(node, key + keypos, keylen - keypos);
+			keypos += segpos;
+		}
+	}
+
+	while (keypos < keylen && segpos == node->seglen) {
+		TrieNode* child = find_child(node, (unsigned char)key[keypos]);
+		if (!child)
+			break;
+		parent = node, node = child;
+		segpos = seg_match(node, key + keypos, keylen - keypos);
+		keypos += segpos;
+	}
+
+	*node_p = node;
+	if (parent_p)
+		*parent_p = parent;
+	*segpos_p = segpos;
+	*keypos_p = keypos;
+}
+
+
+static void graft_init(GraftStack* stack)
+{
+	stack->frames = stack->local;
+	stack->depth = 0;
+	stack->capacity = WALK_LOCAL_DEPTH;
+}
+
+
+static int graft_push(GraftStack* stack, TrieNode* dst, const TrieNode* src)
+{
+	if (stack->depth == stack->capacity) {
+		size_t capacity = 2 * stack->capacity;
+		GraftFrame* frames;
+		if (!VALLOC(frames, GraftFrame, capacity))
+			return -1;
+		memcpy(frames, stack->frames, stack->depth * sizeof *frames);
+		if (stack->frames != stack->local)
+			free(stack->frames);
+		stack->frames = frames;
+		stack->capacity = capacity;
+	}
+	GraftFrame* frame = &stack->frames[stack->depth++];
+	frame->dst = dst;
+	frame->src = *src;
+	return 0;
+}
+
+
+static void graft_release(GraftStack* stack)
+{
+	if (stack->frames != stack->local)
+		free(stack->frames);
+}
+
+
+/* Child of node for byte, unless it is skip */
+static inline TrieNode* graft_match(const TrieNode* node, unsigned char byte,
+				    const TrieNode* skip)
+{
+	TrieNode* child = find_child(node, byte);
+	return child == skip ? NULL : child;
+}
+
+
+/* Grows the child vector of node to capacity, moving *skip along if it is a
+ * child of node */
+static int graft_reserve(Pool* pool, TrieNode* node, size_t capacity,
+			 TrieNode** skip)
+{
+	if (capacity > NODE_MAX_CAPACITY)
+		capacity = NODE_MAX_CAPACITY;
+	if (capacity <= node->capacity)
+		return 0;
+	unsigned char byte = *skip ? node_byte(*skip) : 0;
+	bool moves = *skip && find_child(node, byte) == *skip;
+	if (children_resize(pool, node, capacity, NODE_MAX_CAPACITY) < 0)
+		return -1;
+	if (moves)
+		*skip = find_child(node, byte);
+	return 0;
+}
+
+
+/* Walks key down from the root of trie, leaving out skip, and splits the
+ * node it ends or parts in so that a node ends there. Returns that node and
+ * sets *pos to the length of its key. If key goes on past it, the child
+ * vector of the node grows to fit one more child. */
+static TrieNode* graft_path(Trie* trie, const char* key, size_t len,
+			    TrieNode** skip, size_t* pos)
+{
+	TrieNode* node = trie->root;
+	size_t keypos = 0;
+	while (keypos < len) {
+		TrieNode* child = graft_match(node, (unsigned char)key[keypos],
+					      *skip);
+		if (!child) {
+			if (graft_reserve(trie->pool, node,
+					  node->n_children + 1, skip) < 0)
+				return NULL;
+			break;
+		}
+		size_t common = seg_match(child, key + keypos, len - keypos);
+		if (common < child->seglen) {
+			if (node_split(trie->pool, child, common) < 0)
+				return NULL;
+			++trie->n_nodes;
+		}
+		node = child;
+		keypos += common;
+	}
+	*pos = keypos;
+	return node;
+}
+
+
+/* Gets dst ready for src, a subtree of from whose key is the key of dst, to
+ * be grafted into it by node_graft without allocating. Nodes of both are
+ * split where their segments part, child vectors of dst grow to fit the
+ * children they gain and the stack grows to the depth of the graft. Only
+ * the shape of the tries changes, so that they keep their keys if memory
+ * runs out. Children of dst equal to *skip are left out. */
+static int graft_prepare(Trie* trie, Trie* from, GraftStack* stack,
+			 TrieNode* dst, const TrieNode* src, TrieNode** skip)
+{
+	stack->depth = 0;
+	if (graft_push(stack, dst, src) < 0)
+		return -1;
+
+	while (stack->depth) {
+		GraftFrame frame = stack->frames[--stack->depth];
+		TrieNode* node = frame.dst;
+		const TrieNode* moved = &frame.src;
+		size_t capacity = node->n_children;
+		for (size_t i = 0; i < moved->n_children; ++i) {
+			TrieNode* child = &moved->children[i];
+			TrieNode* match = graft_match(node, node_byte(child),
+						      *skip);
+			if (!match) {
+				++capacity;
+				continue;
+			}
+			size_t common = seg_match(match, node_seg(child),
+						  child->seglen);
+			if (common < match->seglen) {
+				if (node_split(trie->pool, match, common) < 0)
+					return -1;
+				++trie->n_nodes;
+			}
+			if (common < child->seglen) {
+				if (node_split(from->pool, child, common) < 0)
+					return -1;
+				++from->n_nodes;
+			}
+		}
+		if (graft_reserve(trie->pool, node, capacity, skip) < 0)
+			return -1;
+
+		/* Pushes come last, as growing the vector moves the children */
+		for (size_t i = 0; i < moved->n_children; ++i) {
+			const TrieNode* child = &moved->children[i];
+			TrieNode* match = graft_match(node, node_byte(child),
+						      *skip);
+			if (match && graft_push(stack, match, child) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* Grafts src, a subtree taken out of the trie whose key is the key of dst,
+ * into the subtree of dst after graft_prepare got them ready. Values of src
+ * replace the values of the same keys unless resolve picks another value,
+ * and nodes of src are merged into the nodes of dst they line up with, so
+ * that the trie stays compact. */
+static void node_graft(Trie* trie, GraftStack* stack, TrieNode* dst,
+		       const TrieNode* src, TrieResolver resolve)
+{
+	Pool* pool = trie->pool;
+	destructor_t dtor = trie->ops->dtor;
+
+	/* The stack already grew to the depth the graft reaches, so pushes
+	 * cannot fail */
+	stack->depth = 0;
+	graft_push(stack, dst, src);
+
+	while (stack->depth) {
+		GraftFrame frame = stack->frames[--stack->depth];
+		TrieNode* node = frame.dst;
+		TrieNode* moved = &frame.src;
+
+		void *old = node->value, *value = moved->value;
+		if (value && old && resolve) {
+			val_count(trie, old, NULL);
+			val_count(trie, value, NULL);
+			node->value = resolve(old, value);
+			val_count(trie, NULL, node->value);
+			if (dtor && old != node->value)
+				dtor(old);
+			if (dtor && value != node->value)
+				dtor(value);
+		} else if (value) {
+			val_count(trie, old, NULL);
+			val_insert(node, value, dtor);
+		}
+
+		/* Children of moved that node lacks join its vector, which has
+		 * room for them, and the others are grafted in turn once the
+		 * vector is settled */
+		unsigned char shared[NODE_MAX_CAPACITY / 8];
+		memset(shared, 0, sizeof shared);
+		for (size_t i = 0; i < moved->n_children; ++i) {
+			TrieNode* child = &moved->children[i];
+			unsigned char byte = node_byte(child);
+			if (find_child(node, byte))
+				shared[byte / 8] |= 1 << byte % 8;
+			else
+				children_insert(node, child);
+		}
+		for (size_t i = 0; i < moved->n_children; ++i) {
+			const TrieNode* child = &moved->children[i];
+			unsigned char byte = node_byte(child);
+			if (shared[byte / 8] >> byte % 8 & 1)
+				graft_push(stack, find_child(node, byte),
+					   child);
+		}
+		pool_free(pool, moved->children,
+			  children_size(moved->capacity));
+		seg_free(pool, moved);
+		--trie->n_nodes;
+	}
+}
+
+
+/* Moves every key of the trie under prefix, which is not empty, by making
+ * what the root holds the only child of the root. A root without a value
+ * moves as its only child. */
+static int move_all(Trie* trie, const char* prefix, size_t len)
+{
+	TrieNode *root = trie->root, *children, *moved;
+	Pool* pool = trie->pool;
+	const TrieNode* top = !root->value && root->n_children == 1
+			      ? root->children : root;
+	size_t seglen = len + top->seglen;
+	if (!(children = (TrieNode*)pool_alloc(pool, children_size(1))))
+		return -1;
+	moved = &children[0];
+	if (seglen >= SEG_LOCAL_SIZE) {
+		if (!(moved->seg.heap = add_strs(pool, prefix, len,
+						 node_seg(top),
+						 top->seglen))) {
+			pool_free(pool, children, children_size(1));
+			return -1;
+		}
+	} else {
+		memcpy(moved->seg.local, prefix, len);
+		memcpy(moved->seg.local + len, node_seg(top), top->seglen);
+		moved->seg.local[seglen] = '\0';
+	}
+	moved->seglen = seglen;
+	moved->value = top->value;
+	moved->children = top->children;
+	moved->n_children = top->n_children;
+	moved->capacity = top->capacity;
+
+	/* The root stays while moved becomes a node of its own, unless moved
+	 * takes the place of the child of the root */
+	if (top == root) {
+		++trie->n_nodes;
+	} else {
+		seg_free(pool, root->children);
+		pool_free(pool, root->children,
+			  children_size(root->capacity));
+	}
+	root->value = NULL;
+	root->children = children;
+	root->n_children = root->capacity = 1;
+	node_keys(root)[0] = node_byte(moved);
+	root_table_update(trie, root, 0);
+
+	trie->max_keylen_added += len;
+	return 0;
+}
+
+
+static void node_unlink(TrieNode* node)
+{
+	node->seglen = 0;
+	node->children = NULL;
+	node->n_children = node->capacity = 0;
+}
+
+
+/* Copies the segments and child vectors of the subtree of root, which belong
+ * to another pool, into pool, keeping the values. If memory runs out, the
+ * copies made so far are freed and root is left as it was. */
+static int node_clone(Pool* pool, TrieNode* root)
+{
+	TrieNode clone = *root;
+	TrieWalk walk;
+	walk_init(&walk);
+	int rc = walk_push(&walk, &clone, 0, 0);
+
+	while (rc == 0 && walk.depth) {
+		TrieNode* node = walk.frames[--walk.depth].node;
+		size_t size = children_size(node->capacity);
+		char* heap = NULL;
+		TrieNode* children = NULL;
+		if (node->seglen >= SEG_LOCAL_SIZE
+		    && !(heap = (char*)pool_alloc(pool, node->seglen + 1))) {
+			node_unlink(node);
+			rc = -1;
+			break;
+		}
+		if (heap) {
+			memcpy(heap, node->seg.heap, node->seglen + 1);
+			node->seg.heap = heap;
+		}
+		if (node->capacity
+		    && !(children = (TrieNode*)pool_alloc(pool, size))) {
+			node->children = NULL;
+			node->n_children = node->capacity = 0;
+			rc = -1;
+			break;
+		}
+		if (children)
+			memcpy(children, node->children, size);
+		node->children = children;
+
+		for (size_t i = 0; i < node->n_children && rc == 0; ++i)
+			rc = walk_push(&walk, &children[i], 0, 0);
+		if (rc < 0)
+			for (size_t i = 0; i < node->n_children; ++i)
+				node_unlink(&children[i]);
+	}
+
+	/* Nodes left on the walk still point into the other pool */
+	if (rc < 0) {
+		while (walk.depth)
+			node_unlink(walk.frames[--walk.depth].node);
+		node_destroy_all(pool, &clone, NULL, true, NULL);
+	} else {
+		*root = clone;
+	}
+	walk_release(&walk);
+	return rc;
+}
+
+
+/* Starts a batched lookup of key the way find_mismatch starts, but only
+ * prefetches the first node */
+static void find_lane_start(Trie* trie, FindLane* lane, const char* key,
+			    size_t len, size_t index)
+{
+	const TrieNode* node = trie->root;
+	RootTable* table = trie->root_table;
+	lane->keypos = 0;
+	lane->matched = true;
+	if (table && len >= 2) {
+		unsigned char first = (unsigned char)key[0];
+		TrieNode* next = table->nodes[(size_t)first << 8
+					      | (unsigned char)key[1]];
+		if (next) {
+			lane->keypos = next != table->rows[first];
+			lane->matched = false;
+			node = next;
+		}
+	}
+	PREFETCH(node);
+	PREFETCH(key);
+	lane->node = node;
+	lane->key = key;
+	lane->len = len;
+	lane->index = index;
+	lane->fetched = false;
+}
+
+
+/* Advances a batched lookup by one memory access. Returns false once the
+ * lookup is over, leaving the node matching the key or NULL in the lane. */
+static bool find_lane_step(FindLane* lane)
+{
+	const TrieNode* node = lane->node;
+	size_t keypos = lane->keypos, left = lane->len - keypos;
+	if (!lane->fetched) {
+		if (node->seglen >= SEG_LOCAL_SIZE)
+			PREFETCH(node->seg.heap);
+		if (node->n_children > NODE16_MAX && node->seglen < left)
+			PREFETCH(node_index(node) + (unsigned char)
+				 lane->key[keypos + node->seglen]);
+		else if (node->n_children)
+			PREFETCH(node_keys(node));
+		lane->fetched = true;
+		return true;
+	}
+
+	if (!lane->matched) {
+		/* Lookups only need to know if the whole segment matches */
+		if (node->seglen > left
+		    || memcmp(lane->key + keypos, node_seg(node),
+			      node->seglen) != 0) {
+			lane->node = NULL;
+			return false;
+		}
+		keypos += node->seglen;
+	}
+	if (keypos == lane->len)
+		return false;
+
+	const TrieNode* child = find_child(node,
+					   (unsigned char)lane->key[keypos]);
+	if (child)
+		PREFETCH(child);
+	lane->node = child;
+	lane->keypos = keypos;
+	lane->fetched = lane->matched = false;
+	return child != NULL;
+}
+
+
+/* Inserts val under key given where find_mismatch stopped for key */
+static int insert_at(Trie* trie, const char* keystr, size_t len, void* val,
+		     TrieNode* node, size_t segpos, size_t keypos)
+{
+	TrieNode* new_child = NULL;
+	bool err, split = segpos < node->seglen;
+	Pool* pool = trie->pool;
+	if (keypos < len) {
+		err = !(new_child = node_create(pool, keystr + keypos,
+						len - keypos, val))
+		      || node_branch(pool, node, segpos, new_child) < 0;
+	} else {
+		err = node_split(pool, node, segpos) < 0;
+		if (!err) {
+			val_count(trie, node->value, val);
+			val_insert(node, val, trie->ops->dtor);
+		}
+	}
+	if (err) {
+		raw_node_destroy(pool, new_child);
+		return -1;
+	}
+	if (keypos < len) {
+		val_count(trie, NULL, val);
+		++trie->n_nodes;
+	}
+	if (split)
+		++trie->n_nodes;
+	if (keypos < len || split)
+		root_table_update(trie, node, (unsigned char)keystr[0]);
+
+	if (len > trie->max_keylen_added)
+		trie->max_keylen_added = len;
+	return 0;
+}
+
+
+/* Deletes key given where find_mismatch stopped for key. Returns the
+ * deepest node whose segment or child vector may have changed, or NULL if
+ * the trie is unchanged. */
+static TrieNode* delete_at(Trie* trie, const char* key, size_t len,
+			   TrieNode* node, TrieNode* parent, size_t segpos,
+			   size_t keypos)
+{
+	if (keypos < len || segpos < node->seglen
+	    || (!node->value && &node->value != trie->upserted))
+		/* Not found */
+		return NULL;
+
+	destructor_t dtor = trie->ops->dtor;
+	Pool* pool = trie->pool;
+	/* A key left empty by an upsert is counted without its value */
+	if (!node->value)
+		--trie->n_keys;
+	val_count(trie, node->value, NULL);
+
+	if (node->n_children > 1 || !parent) {
+		val_insert(node, NULL, dtor);
+		return NULL;
+	}
+
+	unsigned char first = *(const unsigned char*)key;
+
+	/* A merge that runs out of memory leaves an extra node behind */
+	if (node->n_children == 1) {
+		val_insert(node, NULL, dtor);
+		if (node_merge(pool, node, dtor) == 0)
+			--trie->n_nodes;
+		root_table_update(trie, node, first);
+		return node;
+	}
+
+	node_delchild(pool, parent, node, dtor);
+	--trie->n_nodes;
+	if (!parent->value && parent->n_children == 1 && parent != trie->root
+	    && node_merge(pool, parent, dtor) == 0)
+		--trie->n_nodes;
+	root_table_update(trie, parent, first);
+
+	return parent;
+}
+
+
+/* Compares the keys of two ops sharing their first offset bytes */
+static bool batch_lt(const struct TrieBatchOp* op1,
+		     const struct TrieBatchOp* op2, size_t offset)
+{
+	const char *key1 = (const char*)op1->key, *key2 = (const char*)op2->key;
+	size_t len = op1->len < op2->len ? op1->len : op2->len;
+	size_t common = offset + pflen(key1 + offset, key2 + offset,
+				       len - offset);
+	return common < len ? (unsigned char)key1[common]
+			      < (unsigned char)key2[common]
+			    : op1->len < op2->len;
+}
+
+
+/* Checks whether the ops are in order by key, noting in order how many bytes
+ * each key shares with the one before it */
+static bool batch_sorted(const struct TrieBatchOp* ops, BatchKey* order,
+			 size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		order[i].index = i;
+		order[i].prefix.common = 0;
+	}
+	for (size_t i = 1; i < n; ++i) {
+		const char *key1 = (const char*)ops[i - 1].key,
+			   *key2 = (const char*)ops[i].key;
+		size_t len = ops[i].len < ops[i - 1].len ? ops[i].len
+							 : ops[i - 1].len;
+		size_t common = pflen(key1, key2, len);
+		if (common < len ? (unsigned char)key2[common]
+				   < (unsigned char)key1[common]
+				 : ops[i].len < ops[i - 1].len)
+			return false;
+		order[i].prefix.common = common;
+	}
+	return true;
+}
+
+
+/* Caches the 8 bytes of the keys from base on, zero-padded */
+static void batch_heads(const struct TrieBatchOp* ops, BatchKey* keys,
+			size_t n, size_t base)
+{
+	for (size_t i = 0; i < n; ++i) {
+		const struct TrieBatchOp* op = &ops[keys[i].index];
+		const unsigned char* key = (const unsigned char*)op->key + base;
+		size_t len = op->len - base;
+		unsigned long long head = 0;
+		if (len >= 8) {
+			for (size_t b = 0; b < 8; ++b)
+				head = head << 8 | key[b];
+		} else {
+			for (size_t b = 0; b < 8; ++b)
+				head = head << 8 | (b < len ? key[b] : 0);
+		}
+		keys[i].prefix.head = head;
+	}
+}
+
+
+/* Compares keys of the same range by the bytes of their heads from the
+ * offset of the range on, and by the keys themselves if those are equal */
+static bool batch_key_lt(const struct TrieBatchOp* ops, const BatchKey* bkey1,
+			 const BatchKey* bkey2, const BatchRange* range)
+{
+	size_t shift = 8 * (range->offset - range->base);
+	unsigned long long head1 = bkey1->prefix.head << shift,
+			   head2 = bkey2->prefix.head << shift;
+	return head1 != head2
+		? head1 < head2
+		: batch_lt(&ops[bkey1->index], &ops[bkey2->index],
+			   range->offset);
+}
+
+
+/* Stable insertion sort of a short range, which also notes how many bytes
+ * each of its keys shares with the one before it */
+static void batch_insertion(const struct TrieBatchOp* ops, BatchKey* order,
+			    const BatchRange* range)
+{
+	BatchKey* keys = order + range->lo;
+	size_t n = range->hi - range->lo, offset = range->offset;
+	size_t shift = 8 * (offset - range->base);
+	for (size_t i = 1; i < n; ++i) {
+		BatchKey bkey = keys[i];
+		size_t j = i;
+		for (; j && batch_key_lt(ops, &bkey, &keys[j - 1], range); --j)
+			keys[j] = keys[j - 1];
+		keys[j] = bkey;
+	}
+
+	/* Heads differing in some byte locate where the keys diverge, unless
+	 * one of the keys ends before. Going backwards, each head is replaced
+	 * only once the key before no longer needs it. */
+	for (size_t i = n; i-- > 1;) {
+		const struct TrieBatchOp *op1 = &ops[keys[i - 1].index],
+					 *op2 = &ops[keys[i].index];
+		unsigned long long diff = (keys[i - 1].prefix.head
+					   ^ keys[i].prefix.head) << shift;
+		size_t len = op1->len < op2->len ? op1->len : op2->len;
+		size_t common = offset;
+		if (diff) {
+			for (; !(diff >> 56); diff <<= 8)
+				++common;
+			if (common > len)
+				common = len;
+		} else {
+			common += pflen((const char*)op1->key + offset,
+					(const char*)op2->key + offset,
+					len - offset);
+		}
+		keys[i].prefix.common = common;
+	}
+	keys[0].prefix.common = range->common;
+}
+
+
+/* Stable MSD radix sort of the op indices in order by key, so that ops on
+ * the same key keep their relative order. Ranges are distributed among
+ * buckets by the byte after the offset bytes their keys share, or in a
+ * first bucket if their keys end there, until they are short enough to be
+ * sorted by insertion. Bytes are read from the cached heads, which are
+ * refilled every 8 bytes. Since keys in different buckets share exactly the
+ * offset bytes, the sort also yields how many bytes each key shares with
+ * the one before it. The n / 2 + 1 ranges give room for every range waiting
+ * to be sorted, as they are disjoint and hold at least two ops each. */
+static void batch_sort(const struct TrieBatchOp* ops, BatchKey* order,
+		       BatchKey* tmp, BatchRange* ranges, size_t n)
+{
+	size_t depth = 1, shared;
+	ranges[0].lo = 0;
+	ranges[0].hi = n;
+	ranges[0].offset = ranges[0].base = 0;
+	ranges[0].common = 0;
+	batch_heads(ops, order, n, 0);
+
+	while (depth) {
+		BatchRange range = ranges[--depth];
+		BatchKey* keys = order + range.lo;
+		size_t m = range.hi - range.lo, offset = range.offset;
+		if (offset - range.base >= 8) {
+			batch_heads(ops, keys, m, offset);
+			range.base = offset;
+		}
+		if (m <= BATCH_SORT_SMALL) {
+			batch_insertion(ops, order, &range);
+			continue;
+		}
+
+		size_t shift = 8 * (offset - range.base), ends[257] = { 0 };
+		for (size_t i = 0; i < m; ++i)
+			++ends[ops[keys[i].index].len > offset
+			       ? (size_t)(keys[i].prefix.head << shift >> 56)
+				 + 1
+			       : 0];
+		size_t b = 0;
+		while (b < 256 && ends[b] < m)
+			++b;
+		if (ends[b] == m && b) {
+			/* All keys go on with the same byte, so the range is
+			 * sorted again past all the bytes its keys share */
+			const char* first = (const char*)ops[keys[0].index].key;
+			shared = ops[keys[0].index].len;
+			for (size_t i = 1; i < m; ++i) {
+				const struct TrieBatchOp* op =
+					&ops[keys[i].index];
+				size_t len = op->len < shared ? op->len
+							      : shared;
+				shared = offset
+					 + pflen(first + offset,
+						 (const char*)op->key + offset,
+						 len - offset);
+			}
+			batch_heads(ops, keys, m, shared);
+			range.offset = range.base = shared;
+			ranges[depth++] = range;
+			continue;
+		}
+
+		for (b = 1; b < 257; ++b)
+			ends[b] += ends[b - 1];
+		for (size_t i = m; i-- > 0;)
+			tmp[--ends[ops[keys[i].index].len > offset
+				   ? (size_t)(keys[i].prefix.head << shift
+					      >> 56) + 1
+				   : 0]] = keys[i];
+		memcpy(keys, tmp, m * sizeof *keys);
+
+		/* ends now holds where each bucket starts. Keys ending at the
+		 * offset are all equal. */
+		for (b = 0; b < 257; ++b) {
+			size_t lo = ends[b], hi = b < 256 ? ends[b + 1] : m;
+			if (lo == hi)
+				continue;
+			size_t common = lo ? offset : range.common;
+			if (b == 0 || hi - lo == 1) {
+				keys[lo].prefix.common = common;
+				for (size_t i = lo + 1; i < hi; ++i)
+					keys[i].prefix.common = offset;
+				continue;
+			}
+			BatchRange* sub = &ranges[depth++];
+			sub->lo = range.lo + lo;
+			sub->hi = range.lo + hi;
+			sub->offset = offset + 1;
+			sub->base = range.base;
+			sub->common = common;
+		}
+	}
+}
+
+
+/* Finds the end of the run of sorted ops starting at first whose keys share
+ * their first len bytes, by galloping and then bisecting */
+static size_t batch_group_end(const struct TrieBatchOp* ops,
+			      const BatchKey* order, size_t first, size_t n,
+			      size_t len)
+{
+	const void* key = ops[order[first].index].key;
+	size_t s = first, step = 1;
+	while (s + step < n && ops[order[s + step].index].len >= len
+	       && memcmp(ops[order[s + step].index].key, key, len) == 0) {
+		s += step;
+		step *= 2;
+	}
+
+	size_t e = s + step < n ? s + step : n;
+	while (e - s > 1) {
+		size_t m = s + (e - s) / 2;
+		if (ops[order[m].index].len >= len
+		    && memcmp(ops[order[m].index].key, key, len) == 0)
+			s = m;
+		else
+			e = m;
+	}
+	return e;
+}
+
+
+/* Number of children node has once it gets one for every distinct byte
+ * following its keypos bytes in the ops from first on */
+static size_t batch_capacity(const TrieNode* node,
+			     const struct TrieBatchOp* ops,
+			     const BatchKey* order, size_t first, size_t n,
+			     size_t keypos)
+{
+	const void* key = ops[order[first].index].key;
+	size_t capacity = node->n_children;
+	for (size_t i = first; i < n && capacity < NODE_MAX_CAPACITY;
+	     i = batch_group_end(ops, order, i, n, keypos + 1)) {
+		const struct TrieBatchOp* op = &ops[order[i].index];
+		if (op->len <= keypos || memcmp(op->key, key, keypos) != 0)
+			break;
+		capacity += !find_child(node, ((const unsigned char*)
+					       op->key)[keypos]);
+	}
+	return capacity;
+}
+
+
+/* Grows the child vector of node at once to its batch_capacity, so that the
+ * batch moves the vector at most once. Growth is best effort. */
+static void batch_reserve(Trie* trie, TrieNode* node,
+			  const struct TrieBatchOp* ops, const BatchKey* order,
+			  size_t first, size_t n, size_t keypos)
+{
+	size_t capacity = batch_capacity(node, ops, order, first, n, keypos);
+	if (capacity > node->capacity
+	    && children_resize(trie->pool, node, capacity, (size_t)-1) == 0)
+		root_table_update(trie, node, *(const unsigned char*)
+				  ops[order[first].index].key);
+}
+
+
+/* Adds the inserts from first on that each need a new leaf with a distinct
+ * byte under node by merging them into its children at once. Returns the end
+ * of the run applied, which is first if there is none or memory ran out. */
+static size_t batch_leaves(Trie* trie, TrieNode* node,
+			   struct TrieBatchOp* ops, const BatchKey* order,
+			   size_t first, size_t n, size_t keypos)
+{
+	TrieNode leaves[BATCH_LEAVES];
+	Pool* pool = trie->pool;
+	size_t end = first, k = 0;
+	for (; end < n && k < BATCH_LEAVES; ++end, ++k) {
+		const struct TrieBatchOp* op = &ops[order[end].index];
+		const char* key = (const char*)op->key;
+		if (op->kind != TRIE_BATCH_INSERT || !op->value
+		    || op->len <= keypos
+		    || (end > first && order[end].prefix.common != keypos)
+		    || find_child(node, (unsigned char)key[keypos])
+		    || node_init(pool, &leaves[k], key + keypos,
+				 op->len - keypos, op->value) < 0)
+			break;
+	}
+
+	size_t n_children = node->n_children, capacity = node->capacity;
+	if (k >= 2 && capacity < n_children + k)
+		capacity = batch_capacity(node, ops, order, first, n, keypos);
+
+	TrieNode *children = node->children, *dst = children;
+	if (k >= 2 && capacity > node->capacity)
+		dst = (TrieNode*)pool_alloc(pool, children_size(capacity));
+	if (k < 2 || !dst) {
+		while (k)
+			seg_free(pool, &leaves[--k]);
+		return first;
+	}
+
+	/* Going backwards, each leaf moves the children after it past the
+	 * leaves after it, into a new vector if the old one is too small */
+	unsigned char *keys = node_keys(node),
+		      *dst_keys = (unsigned char*)(dst + capacity);
+	size_t hi = n_children;
+	for (size_t t = k; t-- > 0;) {
+		unsigned char byte = node_byte(&leaves[t]);
+		size_t lo = 0, at = hi;
+		while (lo < at) {
+			size_t m = (lo + at) / 2;
+			if (keys[m] < byte)
+				lo = m + 1;
+			else
+				at = m;
+		}
+		if (at < hi) {
+			memmove(&dst[at + t + 1], &children[at],
+				(hi - at) * sizeof children[0]);
+			memmove(&dst_keys[at + t + 1], &keys[at], hi - at);
+		}
+		dst[at + t] = leaves[t];
+		dst_keys[at + t] = byte;
+		hi = at;
+	}
+	node->n_children = (unsigned short)(n_children + k);
+	if (dst != children) {
+		if (hi) {
+			memcpy(dst, children, hi * sizeof children[0]);
+			memcpy(dst_keys, keys, hi);
+		}
+		pool_free(pool, children, children_size(node->capacity));
+		node->children = dst;
+		node->capacity = (unsigned short)capacity;
+		children_reindex(node, (size_t)-1);
+	} else if (capacity > NODE16_MAX) {
+		unsigned char* index = node_index(node);
+		for (size_t i = hi; i < n_children + k; ++i)
+			index[keys[i]] = (unsigned char)i;
+	}
+
+	for (size_t i = first; i < end; ++i) {
+		struct TrieBatchOp* op = &ops[order[i].index];
+		val_count(trie, NULL, op->value);
+		if (op->len > trie->max_keylen_added)
+			trie->max_keylen_added = op->len;
+		op->result = 0;
+	}
+	trie->n_nodes += end - first;
+	root_table_update(trie, node, *(const unsigned char*)
+			  ops[order[first].index].key);
+	return end;
+}
+
+
+/* Walks the paths of the next ops as a batched lookup, so that the nodes
+ * they touch are fetched together before any of them is changed */
+static void batch_warm(Trie* trie, const struct TrieBatchOp* ops,
+		       const BatchKey* order, size_t first, size_t n)
+{
+	FindLane lanes[FIND_BATCH_WIDTH];
+	size_t n_lanes = 0;
+	for (size_t i = first; i < n && n_lanes < FIND_BATCH_WIDTH; ++i) {
+		const struct TrieBatchOp* op = &ops[order[i].index];
+		find_lane_start(trie, &lanes[n_lanes++], (const char*)op->key,
+				op->len, i);
+	}
+	while (n_lanes)
+		for (size_t i = 0; i < n_lanes;)
+			if (find_lane_step(&lanes[i]))
+				++i;
+			else
+				lanes[i] = lanes[--n_lanes];
+}
+
+
+/* Applies ops in sorted order. The path of fully matched nodes leading to
+ * the last key is kept, so that each key resumes its search below the
+ * prefix it shares with the previous one. Nodes whose segment or child
+ * vector an op may change are dropped from the path. */
+static void batch_apply(Trie* trie, struct TrieBatchOp* ops,
+			const BatchKey* order, size_t n)
+{
+	TrieWalk path;
+	walk_init(&path);
+	walk_push(&path, trie->root, 0, 0);
+
+	bool warm = trie->n_nodes >= BATCH_WARM_NODES;
+	for (size_t i = 0; i < n; ++i) {
+		if (warm && i % FIND_BATCH_WIDTH == 0)
+			batch_warm(trie, ops, order, i, n);
+		struct TrieBatchOp* op = &ops[order[i].index];
+		const char* key = (const char*)op->key;
+		size_t len = op->len, common = order[i].prefix.common;
+
+		while (path.depth > 1
+		       && path.frames[path.depth - 1].keylen > common)
+			--path.depth;
+		WalkFrame* top = &path.frames[path.depth - 1];
+		TrieNode *node = top->node, *parent = NULL;
+		size_t keypos = top->keylen, segpos = node->seglen;
+		if (path.depth > 1)
+			parent = path.frames[path.depth - 2].node;
+
+		bool tracked = true;
+		while (keypos < len) {
+			unsigned char byte = (unsigned char)key[keypos];
+			TrieNode* child = find_child(node, byte);
+			if (!child)
+				break;
+			parent = node, node = child;
+			segpos = seg_match(node, key + keypos, len - keypos);
+			keypos += segpos;
+			if (segpos < node->seglen)
+				break;
+			tracked = tracked
+				  && walk_push(&path, node, 0, keypos) == 0;
+		}
+
+		TrieNode* touched = node;
+		size_t end;
+		if (op->kind != TRIE_BATCH_INSERT) {
+			touched = delete_at(trie, key, len, node, parent,
+					    segpos, keypos);
+			op->result = 0;
+		} else if (!op->value) {
+			op->result = -1;
+		} else if (keypos < len && segpos == node->seglen
+			   && (end = batch_leaves(trie, node, ops, order, i,
+						  n, keypos)) > i) {
+			i = end - 1;
+		} else {
+			if (keypos < len && segpos == node->seglen
+			    && node->n_children == node->capacity)
+				batch_reserve(trie, node, ops, order, i, n,
+					      keypos);
+			op->result = insert_at(trie, key, len, op->value,
+					       node, segpos, keypos);
+		}
+
+		while (path.depth > 1
+		       && (path.frames[path.depth - 1].node == node
+			   || path.frames[path.depth - 1].node == touched))
+			--path.depth;
+	}
+	walk_release(&path);
+}
+
+
+static int node_fork(Pool* pool, TrieNode* node, size_t seglen,
+		     TrieNode* new_child)
+{
+	TrieNode* children;
+	const char* at = node_seg(node) + seglen;
+	bool new_first = node_byte(new_child) < (unsigned char)at[0];
+
+	if (!(children = (TrieNode*)pool_alloc(pool, children_size(2))))
+		return -1;
+	TrieNode* split_child = &children[new_first ? 1 : 0];
+	if (node_init(pool, split_child, at, node->seglen - seglen,
+		      node->value) < 0)
+		goto oom;
+	if (node_setseg(pool, node, node_seg(node), seglen) < 0) {
+		seg_free(pool, split_child);
 		goto oom;
-	del = child - children;
-	sz1 = del * sizeof children[0];
-	sz2 = (n_children - del - 1) * sizeof children[0];
+	}
+	split_child->n_children = node->n_children;
+	split_child->capacity = node->capacity;
+	split_child->children = node->children;
+	children[new_first ? 0 : 1] = *new_child;
+
+	node->children = children;
+	node->n_children = 2;
+	node->capacity = 2;
+	node_keys(node)[0] = node_byte(&children[0]);
+	node_keys(node)[1] = node_byte(&children[1]);
+	node->value = NULL;
+
+	pool_free(pool, new_child, sizeof *new_child);
+	return 0;
+
+oom:
+	pool_free(pool, children, children_size(2));
+	return -1;
+}
 
-	memcpy(new_children, children, sz1);
-	memcpy(&new_children[del], &children[del + 1], sz2);
 
-	node->children = new_children;
+/* Copies child into the child vector of node, which has room for it */
+static void children_insert(TrieNode* node, const TrieNode* child)
+{
+	unsigned char find = node_byte(child);
+	size_t n_children = node->n_children, ins = child_rank(node, find);
+	TrieNode* children = node->children;
+	unsigned char* keys = node_keys(node);
+	memmove(&children[ins + 1], &children[ins],
+		(n_children - ins) * sizeof children[0]);
+	memmove(&keys[ins + 1], &keys[ins], n_children - ins);
+	if (node->capacity > NODE16_MAX) {
+		unsigned char* index = node_index(node);
+		for (size_t i = ins + 1; i <= n_children; ++i)
+			++index[keys[i]];
+		index[find] = (unsigned char)ins;
+	}
+	children[ins] = *child;
+	keys[ins] = find;
+	++node->n_children;
+}
+
+
+static int node_addchild(Pool* pool, TrieNode* node, TrieNode* new_child)
+{
+	unsigned char find = node_byte(new_child);
+	size_t ins = child_rank(node, find), capacity = node->capacity;
+
+	if (node->n_children < capacity) {
+		children_insert(node, new_child);
+	} else {
+		capacity = capacity ? 2 * capacity : 1;
+		if (capacity > NODE_MAX_CAPACITY)
+			capacity = NODE_MAX_CAPACITY;
+		if (children_resize(pool, node, capacity, ins) < 0)
+			return -1;
+		if (capacity > NODE16_MAX)
+			node_index(node)[find] = (unsigned char)ins;
+		node->children[ins] = *new_child;
+		node_keys(node)[ins] = find;
+		++node->n_children;
+	}
+
+	pool_free(pool, new_child, sizeof *new_child);
+	return 0;
+}
+
+
+static int node_branch(Pool* pool, TrieNode* node, size_t at,
+		       TrieNode* child)
+{
+	return at < node->seglen ? node_fork(pool, node, at, child)
+				 : node_addchild(pool, node, child);
+}
+
+
+/* Takes child out of the child vector of node, keeping the vector */
+static void children_remove(TrieNode* node, const TrieNode* child)
+{
+	size_t n_children = node->n_children;
+	size_t del = (size_t)(child - node->children);
+	TrieNode* children = node->children;
+	unsigned char* keys = node_keys(node);
+	if (node->capacity > NODE16_MAX) {
+		unsigned char* index = node_index(node);
+		index[keys[del]] = 0;
+		for (size_t i = del + 1; i < n_children; ++i)
+			--index[keys[i]];
+	}
+	memmove(&children[del], &children[del + 1],
+		(n_children - del - 1) * sizeof children[0]);
+	memmove(&keys[del], &keys[del + 1], n_children - del - 1);
 	--node->n_children;
-	free(children);
+}
+
+
+static void node_delchild(Pool* pool, TrieNode* node, TrieNode* child,
+			  destructor_t dtor)
+{
+	size_t capacity = node->capacity;
+	TrieNode* children = node->children;
+
+	pool_free(pool, child->children, children_size(child->capacity));
+	if (child->value && dtor)
+		dtor(child->value);
+	seg_free(pool, child);
+	children_remove(node, child);
+
+	/* Shrinking is best effort so that deletions never need memory */
+	if (node->n_children == 0) {
+		pool_free(pool, children, children_size(capacity));
+		node->children = NULL;
+		node->capacity = 0;
+	} else if (node->n_children <= capacity / 4) {
+		children_resize(pool, node, capacity / 2, NODE_MAX_CAPACITY);
+	}
+}
+
+
+static inline size_t key_len(const char* const* keys, const size_t* lens,
+			     size_t i)
+{
+	return lens ? lens[i] : strlen(keys[i]);
+}
+
+
+static bool keys_sorted(const char* const* keys, const size_t* lens,
+			void* const* values, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		if (!values[i])
+			return false;
+		if (i == 0)
+			continue;
+
+		size_t prev_len = key_len(keys, lens, i - 1);
+		size_t len = key_len(keys, lens, i);
+		size_t common = pflen(keys[i - 1], keys[i],
+				      prev_len < len ? prev_len : len);
+		if (common == len
+		    || (common < prev_len
+			&& (unsigned char)keys[i - 1][common]
+			   > (unsigned char)keys[i][common]))
+			return false;
+	}
+	return true;
+}
+
+
+/* Finds the end of the run of keys starting at first that share the byte at
+ * pos, by galloping and then bisecting so that wide runs are not scanned */
+static inline size_t group_end(const char* const* keys, size_t first,
+			       size_t hi, size_t pos)
+{
+	char byte = keys[first][pos];
+	size_t s = first, step = 1;
+	while (s + step < hi && keys[s + step][pos] == byte) {
+		s += step;
+		step *= 2;
+	}
+
+	/* keys[s] is in the run and keys[e] is not, or e is hi */
+	size_t e = s + step < hi ? s + step : hi;
+	while (e - s > 1) {
+		size_t m = s + (e - s) / 2;
+		if (keys[m][pos] == byte)
+			s = m;
+		else
+			e = m;
+	}
+	return e;
+}
+
+
+/* Gives the node of frame its value and its final child vector, and pushes a
+ * frame for each child. Children are counted as soon as they are
+ * initialized, so a failure leaves a trie that can be destroyed. */
+static int node_fill(Trie* trie, const BuildFrame* frame,
+		     const char* const* keys, const size_t* lens,
+		     void* const* values, BuildFrame** stack_p,
+		     size_t* depth_p, size_t* capacity_p)
+{
+	TrieNode* node = frame->node;
+	size_t lo = frame->lo, hi = frame->hi, pos = frame->pos;
+
+	if (key_len(keys, lens, lo) == pos) {
+		node->value = values[lo];
+		val_count(trie, NULL, values[lo++]);
+	}
+	if (lo == hi)
+		return 0;
+
+	/* Runs of keys sharing the byte at pos become children */
+	size_t ends[NODE_MAX_CAPACITY], n_children = 0;
+	for (size_t i = lo; i < hi; i = ends[n_children++])
+		ends[n_children] = group_end(keys, i, hi, pos);
+	TrieNode* children;
+	if (!(children = (TrieNode*)pool_alloc(trie->pool,
+					       children_size(n_children))))
+		return -1;
+	node->children = children;
+	node->capacity = (unsigned short)n_children;
+
+	if (*depth_p + n_children > *capacity_p) {
+		size_t capacity = 2 * *capacity_p + n_children;
+		BuildFrame* stack;
+		if (!(stack = (BuildFrame*)realloc(*stack_p,
+						   capacity * sizeof *stack)))
+			return -1;
+		*stack_p = stack;
+		*capacity_p = capacity;
+	}
 
-	free(child_segment);
-	free(child_children);
-	if (child_value && dtor)
-		dtor(child_value);
+	for (size_t c = 0, first = lo; c < n_children; first = ends[c++]) {
+		size_t end = ends[c], len = key_len(keys, lens, first);
+		unsigned char byte = (unsigned char)keys[first][pos];
+
+		/* Sorted keys share the prefix of the first and last ones */
+		size_t last_len = key_len(keys, lens, end - 1);
+		size_t seglen = end - first == 1 ? len - pos
+			: pflen(keys[first] + pos, keys[end - 1] + pos,
+				(len < last_len ? len : last_len) - pos);
+
+		TrieNode* child = &children[node->n_children];
+		if (node_init(trie->pool, child, keys[first] + pos, seglen,
+			      NULL) < 0)
+			return -1;
+		node_keys(node)[node->n_children++] = byte;
+		++trie->n_nodes;
+
+		BuildFrame* next = &(*stack_p)[(*depth_p)++];
+		next->node = child;
+		next->lo = first;
+		next->hi = end;
+		next->pos = pos + seglen;
+	}
+	children_reindex(node, (size_t)-1);
 	return 0;
+}
 
-oom:
-	return -1;
+
+static int build_all(Trie* trie, const char* const* keys, const size_t* lens,
+		     void* const* values, size_t n)
+{
+	if (!n)
+		return 0;
+
+	size_t depth = 0, capacity = WALK_LOCAL_DEPTH;
+	BuildFrame* stack;
+	if (!VALLOC(stack, BuildFrame, capacity))
+		return -1;
+	stack[depth].node = trie->root;
+	stack[depth].lo = 0;
+	stack[depth].hi = n;
+	stack[depth++].pos = 0;
+
+	int rc = 0;
+	while (depth && rc == 0) {
+		BuildFrame frame = stack[--depth];
+		rc = node_fill(trie, &frame, keys, lens, values, &stack,
+			       &depth, &capacity);
+	}
+	free(stack);
+
+	for (size_t i = 0; i < n; ++i) {
+		size_t len = key_len(keys, lens, i);
+		if (len > trie->max_keylen_added)
+			trie->max_keylen_added = len;
+	}
+	root_table_update(trie, trie->root, 0);
+	return rc;
+}
+
+
+static void root_row_build(RootTable* table, const TrieNode* root,
+			   unsigned char first)
+{
+	TrieNode** row = &table->nodes[(size_t)first << 8];
+	TrieNode* child = find_child(root, first);
+	for (size_t i = 0; i < ROOT_TABLE_ROWS; ++i)
+		row[i] = NULL;
+
+	table->rows[first] = child;
+	if (!child)
+		return;
+	if (child->seglen > 1) {
+		row[(unsigned char)node_seg(child)[1]] = child;
+		return;
+	}
+	for (size_t i = 0; i < child->n_children; ++i)
+		row[node_byte(&child->children[i])] = &child->children[i];
+}
+
+
+/* Called after the children or segment of touched changed on the path of a
+ * key starting with first. Changes to the children of the root may move all
+ * of its children, while deeper changes only concern the row of first. */
+static void root_table_update(Trie* trie, const TrieNode* touched,
+			      unsigned char first)
+{
+	RootTable* table = trie->root_table;
+	if (!table)
+		return;
+
+	if (touched == trie->root) {
+		for (size_t i = 0; i < ROOT_TABLE_ROWS; ++i)
+			root_row_build(table, touched, (unsigned char)i);
+	} else if (touched == table->rows[first]) {
+		root_row_build(table, trie->root, first);
+	}
+}
+
+
+/* Called after changes below the children of the root on the paths of key
+ * and of keys starting with first, given the children the root had before.
+ * The rows of both are rebuilt, or every row if the children of the root
+ * moved or key is empty. */
+static void root_table_sync(Trie* trie, const TrieNode* children,
+			    size_t n_children, const char* key, size_t len,
+			    unsigned char first)
+{
+	RootTable* table = trie->root_table;
+	TrieNode* root = trie->root;
+	if (!table)
+		return;
+
+	if (!len || root->children != children
+	    || root->n_children != n_children) {
+		root_table_update(trie, root, 0);
+		return;
+	}
+	root_row_build(table, root, (unsigned char)key[0]);
+	if ((unsigned char)key[0] != first)
+		root_row_build(table, root, first);
 }
 
 
-static inline char* key_buffer_create(size_t max_keylen)
+static inline char* key_buffer_create(size_t keycap)
 {
 	char* buf;
-	if (!VALLOC(buf, char, max_keylen + 1))
+	if (!VALLOC(buf, char, keycap + 1))
 		return NULL;
 	buf[0] = '\0';
 	return buf;
@@ -563,124 +2762,572 @@ static inline char* key_buffer_create(size_t max_keylen)
 
 static inline char* segncpy(char* dest, const char* src, size_t n)
 {
-	while (n-- && (*dest++ = *src++));
-	return dest - 1;
+	memcpy(dest, src, n);
+	dest[n] = '\0';
+	return dest + n;
+}
+
+
+static int key_reserve(TrieIterator* iter, size_t keylen)
+{
+	size_t keycap = 2 * iter->keycap;
+	if (keycap < keylen)
+		keycap = keylen;
+	if (keycap > iter->max_keylen)
+		keycap = iter->max_keylen;
+
+	char* key;
+	if (!(key = (char*)realloc(iter->key, keycap + 1)))
+		return -1;
+	iter->key = key;
+	iter->keycap = keycap;
+	return 0;
+}
+
+
+static inline TrieNode* iter_node(const TrieIterator* iter)
+{
+	const TrieWalk* walk = &iter->walk;
+	if (!walk->depth)
+		return iter->start;
+	const WalkFrame* frame = &walk->frames[walk->depth - 1];
+	return &frame->node->children[frame->index];
+}
+
+
+/* Appends the segment of the node at the cursor to the key. Returns 1, 0 if
+ * the key would exceed the maximum length or -1 if out of memory. */
+static int iter_enter(TrieIterator* iter)
+{
+	TrieNode* node = iter_node(iter);
+	size_t keylen = iter->walk.frames[iter->walk.depth - 1].keylen;
+	size_t keyend = keylen + node->seglen;
+
+	if (keyend > iter->max_keylen)
+		return 0;
+	if (keyend > iter->keycap && key_reserve(iter, keyend) < 0)
+		return -1;
+	segncpy(iter->key + keylen, node_seg(node), node->seglen);
+	iter->keylen = keyend;
+	return 1;
+}
+
+
+/* Moves the cursor past the subtree of the node at the cursor. Returns 1, 0
+ * at the end of the walk or -1 if out of memory. */
+static int iter_skip(TrieIterator* iter)
+{
+	TrieWalk* walk = &iter->walk;
+	for (;;) {
+		WalkFrame* frame;
+		do {
+			if (!walk->depth)
+				return 0;
+			frame = &walk->frames[--walk->depth];
+		} while (frame->index + 1 == frame->node->n_children);
+		++frame->index;
+		++walk->depth;
+
+		int entered = iter_enter(iter);
+		if (entered)
+			return entered;
+	}
+}
+
+
+/* Moves the cursor to the next node in preorder. Children add at least one
+ * byte each, so none are entered once the key reaches the maximum length. */
+static int iter_forward(TrieIterator* iter)
+{
+	TrieNode* node = iter_node(iter);
+	if (!node->n_children || iter->keylen >= iter->max_keylen)
+		return iter_skip(iter);
+	if (walk_push(&iter->walk, node, 0, iter->keylen) < 0)
+		return -1;
+
+	int entered = iter_enter(iter);
+	return entered ? entered : iter_skip(iter);
+}
+
+
+/* Moves the cursor from the start node down the search path of key to the
+ * first node whose key is not less than key, or greater than key if strict.
+ * Returns 1, 0 if there is no such node or -1 if out of memory. */
+static int iter_seek(TrieIterator* iter, const char* key, size_t keylen,
+		     bool strict)
+{
+	size_t keypos = iter->keylen;
+	for (;;) {
+		TrieNode* node = iter_node(iter);
+		if (keypos == keylen)
+			return strict ? iter_forward(iter) : 1;
+
+		unsigned char byte = (unsigned char)key[keypos];
+		size_t index = child_rank(node, byte);
+		if (index == node->n_children)
+			return iter_skip(iter);
+		if (walk_push(&iter->walk, node, index, keypos) < 0
+		    || iter_enter(iter) < 0)
+			return -1;
+
+		TrieNode* child = &node->children[index];
+		if (node_byte(child) != byte)
+			/* The child and its subtree follow key */
+			return 1;
+		size_t matched = seg_match(child, key + keypos,
+					   keylen - keypos);
+		keypos += matched;
+		if (matched == child->seglen)
+			continue;
+		if (keypos == keylen)
+			return 1;
+		if ((unsigned char)node_seg(child)[matched]
+		    > (unsigned char)key[keypos])
+			return 1;
+		return iter_skip(iter);
+	}
+}
+
+
+/* Moves the cursor to the last node in preorder of its subtree */
+static int iter_last(TrieIterator* iter)
+{
+	TrieWalk* walk = &iter->walk;
+	for (;;) {
+		TrieNode* node = iter_node(iter);
+		if (!node->n_children || iter->keylen >= iter->max_keylen)
+			return 0;
+		if (walk_push(walk, node, node->n_children - 1,
+			      iter->keylen) < 0)
+			return -1;
+
+		int entered;
+		while (!(entered = iter_enter(iter))) {
+			WalkFrame* frame = &walk->frames[walk->depth - 1];
+			if (frame->index == 0) {
+				--walk->depth;
+				return 0;
+			}
+			--frame->index;
+		}
+		if (entered < 0)
+			return -1;
+	}
 }
 
 
-static inline char* key_add_segment(char* key, const char* segment,
-				    char* keybuf, size_t max_keylen)
+/* Moves the cursor to the previous node in preorder. Returns 1, 0 at the
+ * start of the walk or -1 if out of memory. */
+static int iter_back(TrieIterator* iter)
 {
-	char* keybuf_end = keybuf + max_keylen + 1;
-	ptrdiff_t keybuf_left = keybuf_end - key;
-	char* key_end = segncpy(key, segment, (size_t)keybuf_left);
-	return *key_end ? NULL : key_end;
+	TrieWalk* walk = &iter->walk;
+	while (walk->depth) {
+		WalkFrame* frame = &walk->frames[walk->depth - 1];
+		if (frame->index == 0) {
+			--walk->depth;
+			iter->keylen = frame->keylen;
+			iter->key[iter->keylen] = '\0';
+			return 1;
+		}
+		--frame->index;
+		int entered = iter_enter(iter);
+		if (entered)
+			return entered < 0 || iter_last(iter) < 0 ? -1 : 1;
+	}
+	return 0;
 }
 
 
-static bool trie_iter_step(TrieIterator** iter_p)
+static bool trie_iter_step(TrieIterator** iter_p, bool forward)
 {
 	TrieIterator* iter = *iter_p;
 	if (!iter)
 		return true;
 
+	int moved = forward ? iter_forward(iter)
+		    : iter_node(iter) != iter->first ? iter_back(iter) : 0;
+	if (moved <= 0 || iter_node(iter) == iter->end) {
+		trie_iter_destroy(iter);
+		*iter_p = NULL;
+		return true;
+	}
+	return (iter->value = iter_node(iter)->value) ? true : false;
+}
+
+
+static TrieIterator* iter_find(Trie* trie, const void* key_prefix,
+			       size_t len, size_t max_keylen, bool last)
+{
+	TrieIterator* iter;
+	if (!(iter = iter_prefix_alloc(trie, key_prefix, len, max_keylen)))
+		return NULL;
+	if (last && iter_last(iter) < 0) {
+		trie_iter_destroy(iter);
+		return NULL;
+	}
+	return iter_settle(iter, !last);
+}
+
+
+/* Creates an iterator positioned at the node completing key_prefix */
+static TrieIterator* iter_prefix_alloc(Trie* trie, const void* key_prefix,
+				       size_t len, size_t max_keylen)
+{
 	TrieNode* node;
-	char *keyptr, *keyend;
-	Stack* node_stack = iter->node_stack;
-	Stack* keyptr_stack = iter->keyptr_stack;
-	const size_t max_keylen = iter->max_keylen;
-	char* key = iter->key;
-
-	if (stack_empty(node_stack))
-		goto end_iterator;
-
-	node = (TrieNode*)stack_pop(node_stack);
-	keyptr = (char*)stack_pop(keyptr_stack);
-	keyend = key_add_segment(keyptr, node->segment, key, max_keylen);
-	if (!keyend)
-		return false;
+	size_t segpos, keypos;
+	find_mismatch(trie, (const char*)key_prefix, len, &node, NULL, &segpos,
+		      &keypos);
 
-	for (size_t i = node->n_children; i != 0; --i)
-		if (stack_push(node_stack, &node->children[i - 1]) < 0
-		    || stack_push(keyptr_stack, keyend) < 0)
-			goto oom;
+	if (keypos < len)
+		/* Full prefix not found */
+		return NULL;
+
+	size_t trunc_len = len + node->seglen - segpos;
+	char* trunc_prefix = add_strs(NULL, (const char*)key_prefix, len,
+				      node_seg(node) + segpos,
+				      node->seglen - segpos);
+	if (!trunc_prefix)
+		return NULL;
+
+	TrieIterator* iter = iter_alloc(trunc_prefix, trunc_len, node,
+					max_keylen);
+	free(trunc_prefix);
+	return iter;
+}
 
-	return (iter->value = node->value) ? true : false;
 
-oom:
-end_iterator:
-	trie_iter_destroy(iter);
-	*iter_p = NULL;
-	return true;
+/* Creates an iterator over the whole trie positioned at the first node whose
+ * key is not less than key, or greater than key if strict */
+static TrieIterator* iter_seek_alloc(Trie* trie, const void* key, size_t len,
+				     bool strict)
+{
+	TrieIterator* iter;
+	if (!(iter = iter_alloc("", 0, trie->root, TRIE_KEYLEN_ANY)))
+		return NULL;
+	if (iter_seek(iter, (const char*)key, len, strict) <= 0) {
+		trie_iter_destroy(iter);
+		return NULL;
+	}
+	return iter;
 }
 
 
-static TrieIterator* trie_iter_create(const char* truncated_prefix,
-				      TrieNode* node, size_t max_keylen)
+static TrieIterator* iter_seek_create(Trie* trie, const void* key,
+				      size_t len, bool strict)
 {
-	TrieIterator* iter = NULL;
-	char *keybuf = NULL, *child_keyptr;
-	Stack *node_stack = NULL, *keyptr_stack = NULL;
+	TrieIterator* iter = iter_seek_alloc(trie, key, len, strict);
+	return iter ? iter_settle(iter, true) : NULL;
+}
 
-	if (!ALLOC(iter, TrieIterator))
-		goto oom;
 
-	if (!(keybuf = key_buffer_create(max_keylen)))
-		goto oom;
-	if (!(child_keyptr = key_add_segment(keybuf, truncated_prefix, keybuf,
-					     max_keylen)))
+static TrieIterator* iter_settle(TrieIterator* iter, bool forward)
+{
+	if (iter_node(iter) == iter->end) {
+		trie_iter_destroy(iter);
+		return NULL;
+	}
+	if ((iter->value = iter_node(iter)->value))
+		return iter;
+	while (!trie_iter_step(&iter, forward))
+		continue;
+	return iter;
+}
+
+
+static TrieIterator* iter_clone(const TrieIterator* src)
+{
+	TrieIterator* iter;
+	if (!(iter = iter_alloc(src->key, src->keylen, src->start,
+				src->max_keylen)))
+		return NULL;
+	for (size_t i = 0; i < src->walk.depth; ++i) {
+		const WalkFrame* frame = &src->walk.frames[i];
+		if (walk_push(&iter->walk, frame->node, frame->index,
+			      frame->keylen) < 0) {
+			trie_iter_destroy(iter);
+			return NULL;
+		}
+	}
+	return iter;
+}
+
+
+/* Collects in preorder the nodes of the first level below start holding at
+ * least want nodes, or of the widest level if none does. Levels narrower
+ * than the ones above them are passed through rather than ending the
+ * descent, so that a chain of single children, such as a long prefix shared
+ * by all keys, does not hide the wide levels below it. */
+static TrieNode** level_widen(TrieNode* start, size_t want, size_t* n_p,
+			      size_t* depth_p)
+{
+	TrieNode **level, **best;
+	size_t n = 1, depth = 0, n_best = 1, best_depth = 0;
+	if (!VALLOC(level, TrieNode*, 1))
+		return NULL;
+	level[0] = start;
+	best = level;
+
+	while (n_best < want) {
+		size_t n_next = 0;
+		for (size_t i = 0; i < n; ++i)
+			n_next += level[i]->n_children;
+		if (!n_next)
+			break;
+
+		TrieNode** next;
+		if (!VALLOC(next, TrieNode*, n_next)) {
+			if (level != best)
+				free(level);
+			free(best);
+			return NULL;
+		}
+		n_next = 0;
+		for (size_t i = 0; i < n; ++i)
+			for (size_t c = 0; c < level[i]->n_children; ++c)
+				next[n_next++] = &level[i]->children[c];
+		if (level != best)
+			free(level);
+		level = next;
+		n = n_next;
+		++depth;
+		if (n > n_best) {
+			free(best);
+			best = level;
+			n_best = n;
+			best_depth = depth;
+		}
+	}
+	if (level != best)
+		free(level);
+	*n_p = n_best;
+	*depth_p = best_depth;
+	return best;
+}
+
+
+/* Creates an iterator positioned at node, whose key is the given prefix */
+static TrieIterator* iter_alloc(const char* truncated_prefix,
+				size_t prefix_len, TrieNode* node,
+				size_t max_keylen)
+{
+	TrieIterator* iter = NULL;
+	char* keybuf = NULL;
+	size_t keycap;
+
+	if (prefix_len > max_keylen)
 		goto return_empty_iterator;
 
-	if (!(node_stack = stack_create(STACK_OPS_NONE))
-	    || !(keyptr_stack = stack_create(STACK_OPS_NONE)))
+	keycap = max_keylen < KEY_MIN_CAPACITY ? max_keylen : KEY_MIN_CAPACITY;
+	if (keycap < prefix_len)
+		keycap = prefix_len;
+	if (!ALLOC(iter, TrieIterator)
+	    || !(keybuf = key_buffer_create(keycap)))
 		goto oom;
-	for (size_t i = node->n_children; i != 0; --i)
-		if (stack_push(node_stack, &node->children[i - 1]) < 0
-		    || stack_push(keyptr_stack, child_keyptr) < 0)
-			goto oom;
+	segncpy(keybuf, truncated_prefix, prefix_len);
 
-	iter->node_stack = node_stack;
-	iter->keyptr_stack = keyptr_stack;
+	walk_init(&iter->walk);
+	iter->start = node;
 	iter->max_keylen = max_keylen;
 	iter->key = keybuf;
-	iter->value = node->value;
-
-	if (iter->value)
-		return iter;
-
-	while (!trie_iter_step(&iter))
-		continue;
+	iter->keylen = prefix_len;
+	iter->keycap = keycap;
+	iter->first = iter->end = NULL;
+	iter->value = NULL;
 	return iter;
 
 oom:
 return_empty_iterator:
 	free(iter);
 	free(keybuf);
-	stack_destroy(node_stack);
-	stack_destroy(keyptr_stack);
 	return NULL;
 }
 
 
-static size_t node_memory_usage(TrieNode* node, memusage_t val_usage)
+/* Calls visitor on every value under key_prefix in preorder. The key is
+ * only built if with_keys is set. Frames hold the index of the next child to
+ * visit and are dropped as soon as their last child is taken. */
+static int visit_all(Trie* trie, const void* key_prefix, size_t len,
+		     TrieVisitor visitor, void* ctx, bool with_keys)
 {
-	size_t n_children, result;
+	TrieNode* node;
+	size_t segpos, keypos;
+	find_mismatch(trie, (const char*)key_prefix, len, &node, NULL, &segpos,
+		      &keypos);
+	if (keypos < len)
+		return 0;
+
+	char* key = NULL;
+	size_t keylen = len + node->seglen - segpos, keycap = keylen;
+	if (with_keys
+	    && !(key = add_strs(NULL, (const char*)key_prefix, len,
+				node_seg(node) + segpos,
+				node->seglen - segpos)))
+		return -1;
+
+	TrieWalk walk;
+	walk_init(&walk);
+	int rc = 0;
+	if (node->value && visitor(key, keylen, node->value, ctx))
+		rc = 1;
+	else if (node->n_children && walk_push(&walk, node, 0, keylen) < 0)
+		rc = -1;
+
+	while (!rc && walk.depth) {
+		WalkFrame* frame = &walk.frames[walk.depth - 1];
+		TrieNode* child = &frame->node->children[frame->index];
+		size_t base = frame->keylen;
+		if (++frame->index == frame->node->n_children)
+			--walk.depth;
+
+		keylen = base + child->seglen;
+		if (with_keys) {
+			if (keylen > keycap) {
+				char* grown;
+				keycap = 2 * keycap > keylen ? 2 * keycap
+							     : keylen;
+				grown = (char*)realloc(key, keycap + 1);
+				if (!grown) {
+					rc = -1;
+					break;
+				}
+				key = grown;
+			}
+			segncpy(key + base, node_seg(child), child->seglen);
+		}
+
+		if (child->value && visitor(key, keylen, child->value, ctx))
+			rc = 1;
+		else if (child->n_children
+			 && walk_push(&walk, child, 0, keylen) < 0)
+			rc = -1;
+	}
+
+	walk_release(&walk);
+	free(key);
+	return rc;
+}
+
 
+static inline unsigned walker_state(const struct TrieWalker* walker)
+{
+	const TrieNode* node = walker->node;
 	if (!node)
 		return 0;
+	if (walker->segpos < node->seglen)
+		return TRIE_WALK_MORE;
+	return (node->value ? TRIE_WALK_VALUE : 0)
+	       | (node->n_children ? TRIE_WALK_MORE : 0);
+}
 
-	n_children = node->n_children;
-	result = sizeof *node;
 
-	result += strlen(node->segment) + 1;
-	for (size_t i = 0; i < n_children; ++i)
-		result += node_memory_usage(&node->children[i], val_usage);
-	if (val_usage)
-		result += val_usage(node->value);
+unsigned trie_walker_init(struct TrieWalker* walker, const Trie* trie)
+{
+	walker->node = trie->root;
+	walker->segpos = trie->root->seglen;
+	return walker_state(walker);
+}
 
-	return result;
+
+unsigned trie_walker_step(struct TrieWalker* walker, unsigned char byte)
+{
+	const TrieNode* node = walker->node;
+	if (!node)
+		return 0;
+
+	if (walker->segpos < node->seglen) {
+		if ((unsigned char)node_seg(node)[walker->segpos] == byte)
+			++walker->segpos;
+		else
+			walker->node = NULL;
+	} else {
+		walker->node = find_child(node, byte);
+		walker->segpos = 1;
+	}
+	return walker_state(walker);
+}
+
+
+unsigned trie_walker_feed(struct TrieWalker* walker, const void* bytes,
+			  size_t len)
+{
+	const char* key = (const char*)bytes;
+	const TrieNode* node = walker->node;
+	size_t segpos = walker->segpos;
+
+	while (len && node) {
+		if (segpos == node->seglen) {
+			node = find_child(node, (unsigned char)key[0]);
+			segpos = 0;
+			continue;
+		}
+		size_t n = node->seglen - segpos;
+		if (n > len)
+			n = len;
+		if (pflen(key, node_seg(node) + segpos, n) < n)
+			node = NULL;
+		segpos += n, key += n, len -= n;
+	}
+
+	walker->node = node;
+	walker->segpos = segpos;
+	return walker_state(walker);
+}
+
+
+void* trie_walker_value(const struct TrieWalker* walker)
+{
+	if (!(walker_state(walker) & TRIE_WALK_VALUE))
+		return NULL;
+	return walker->node->value;
+}
+
+
+static void walk_init(TrieWalk* walk)
+{
+	walk->frames = walk->local;
+	walk->depth = 0;
+	walk->capacity = WALK_LOCAL_DEPTH;
+}
+
+
+static int walk_push(TrieWalk* walk, TrieNode* node, size_t index,
+		     size_t keylen)
+{
+	if (walk->depth == walk->capacity) {
+		size_t capacity = 2 * walk->capacity;
+		WalkFrame* frames;
+		if (!VALLOC(frames, WalkFrame, capacity))
+			return -1;
+		memcpy(frames, walk->frames, walk->depth * sizeof *frames);
+		if (walk->frames != walk->local)
+			free(walk->frames);
+		walk->frames = frames;
+		walk->capacity = capacity;
+	}
+	WalkFrame* frame = &walk->frames[walk->depth++];
+	frame->node = node;
+	frame->index = index;
+	frame->keylen = keylen;
+	return 0;
+}
+
+
+static void walk_release(TrieWalk* walk)
+{
+	if (walk->frames != walk->local)
+		free(walk->frames);
 }
 
 
 #undef ALLOC
 #undef VALLOC
+#undef PREFETCH
+#undef FORCE_INLINE
+#undef FIND_BATCH_WIDTH
+#undef WALK_LOCAL_DEPTH
+#undef SPLIT_LEVEL_NODES
+#undef BATCH_SORT_SMALL
+#undef BATCH_LEAVES
+#undef BATCH_WARM_NODES
+#undef KEY_MIN_CAPACITY
+#undef ROOT_TABLE_ROWS
@@ -49,6 +49,29 @@ typedef struct Trie Trie;
 #endif /* TRIE_FWD */
 
 
+/**
+ * Allocate nodes and segments from memory chunks owned by the trie.
+ *
+ * Trades some slack memory for far fewer calls to <code>malloc()</code>.
+ * Destroying a trie created with this flag releases its memory chunk by chunk
+ * and only visits nodes if a value destructor is set.
+ */
+#define TRIE_ARENA 0x1u
+
+/**
+ * Jump from the root straight to the node selected by the first two key
+ * bytes.
+ *
+ * Lookups of keys of two or more bytes jump to the grandchild of the root
+ * for the second byte when the child for the first byte has a one-byte
+ * segment, and otherwise to that child, so that they skip one or two levels
+ * of the trie. The table takes 514 KiB on 64-bit systems. It is kept up to
+ * date by insertions and deletions, which pay for rebuilding all of it
+ * whenever the set of distinct first key bytes changes.
+ */
+#define TRIE_ROOT_TABLE 0x2u
+
+
 /**
  * Instantiate a trie.
  *
@@ -57,10 +80,45 @@ typedef struct Trie Trie;
  */
 Trie* trie_create(const struct TrieOps ops);
 
+/**
+ * Instantiate a trie with creation flags.
+ *
+ * @param ops Set of trie value operations
+ * @param flags Bitwise OR of <code>TRIE_ARENA</code>,
+ *              <code>TRIE_ROOT_TABLE</code> or 0
+ * @returns Allocated trie structure or NULL if out of memory
+ */
+Trie* trie_create_flags(const struct TrieOps ops, unsigned flags);
+
+/**
+ * Build a trie from keys in ascending order.
+ *
+ * Keys are compared byte by byte as unsigned characters, and a key sorts
+ * before all longer keys it prefixes. Every node and child vector is
+ * allocated once with its final size, so this is much faster than inserting
+ * the keys one by one.
+ *
+ * NULL will be returned either if the amount of free memory required is not
+ * available, if the keys are not strictly ascending or if a value is NULL. In
+ * case of failure, no value is destroyed.
+ *
+ * @param ops Set of trie value operations
+ * @param flags Creation flags, as per <code>trie_create_flags</code>
+ * @param keys Keys in ascending order
+ * @param lens Number of bytes in each key, or NULL if keys are C-strings
+ * @param values Value of each key
+ * @param n Number of keys
+ * @returns Allocated trie structure or NULL
+ */
+Trie* trie_build_sorted(const struct TrieOps ops, unsigned flags,
+			const char* const* keys, const size_t* lens,
+			void* const* values, size_t n);
+
 /**
  * Destroy a trie.
  *
- * @param trie Trie returned by <code>trie_create</code>
+ * @param trie Trie returned by <code>trie_create</code> or
+ *             <code>trie_create_flags</code>
  */
 void trie_destroy(Trie* trie);
 
@@ -69,6 +127,9 @@ void trie_destroy(Trie* trie);
  *
  * Sizes of keys that were previously added but do not exist are counted.
  * Sizes of keys that were not added due to a failure are not counted.
+ * Moving keys under a longer prefix raises the size by the difference in
+ * length without finding the longest moved key, so that it may exceed the
+ * size of every key added.
  *
  * @param trie Trie context
  * @returns Size of the longest key
@@ -92,18 +153,208 @@ size_t trie_maxkeylen_added(Trie* trie);
  */
 int trie_insert(Trie* trie, char* key, void* val);
 
+/**
+ * Insert a key-value pair into a trie given the length of the key.
+ *
+ * Behaves like <code>trie_insert</code>, except that the key may contain
+ * zero bytes and is not scanned for a terminator.
+ *
+ * @param trie Trie context
+ * @param key Bytes of the key
+ * @param len Number of bytes in the key
+ * @param val Non-null pointer to the value
+ * @returns 0 on success or -1 on failure
+ */
+int trie_insert_n(Trie* trie, const void* key, size_t len, void* val);
+
+/**
+ * Get the value slot of a key, adding the key if missing.
+ *
+ * The key is searched for once. If it is missing, it is added with an empty
+ * slot, into which the caller must store a non-null value before the next
+ * call on the trie. A caller that cannot produce the value must instead
+ * delete the key with <code>trie_delete</code> right away, which removes it
+ * without calling the destructor. On tries whose operations measure values
+ * with <code>memusage</code>, the value in the slot is measured by the next
+ * call on the trie, so it may be replaced or resized until then.
+ *
+ * @param trie Trie context
+ * @param key C-string of the key
+ * @param inserted Set to 1 if the key was added or 0 otherwise, if not NULL
+ * @returns Slot of the value of the key, or NULL on failure
+ */
+void** trie_upsert(Trie* trie, char* key, int* inserted);
+
+/**
+ * Get the value slot of a key given the length of the key, adding the key
+ * if missing.
+ *
+ * @param trie Trie context
+ * @param key Bytes of the key
+ * @param len Number of bytes in the key
+ * @param inserted Set to 1 if the key was added or 0 otherwise, if not NULL
+ * @returns Slot of the value of the key, or NULL on failure
+ */
+void** trie_upsert_n(Trie* trie, const void* key, size_t len, int* inserted);
+
 /**
  * Delete a key from the trie.
  *
- * The deletion will fail if the required amount of free memory is not
- * available. In case of failure, the trie is left unchanged.
+ * Deletion does not allocate memory and cannot fail. If memory runs out while
+ * merging the nodes left behind, the key is still removed but the trie may
+ * keep an extra node.
  *
  * @param trie Trie context
  * @param key C-string of the key to remove
- * @returns 0 on success or -1 on failure
+ * @returns 0
  */
 int trie_delete(Trie* trie, char* key);
 
+/**
+ * Delete a key from the trie given the length of the key.
+ *
+ * @param trie Trie context
+ * @param key Bytes of the key to remove
+ * @param len Number of bytes in the key
+ * @returns 0
+ */
+int trie_delete_n(Trie* trie, const void* key, size_t len);
+
+/**
+ * Delete every key starting with a prefix.
+ *
+ * The subtree holding the keys is detached from the trie in one step and its
+ * nodes and values are released in bulk, with values destroyed through the
+ * <code>dtor</code> operation. Like <code>trie_delete</code>, this does not
+ * allocate memory and cannot fail.
+ *
+ * @param trie Trie context
+ * @param key_prefix C-string prefix of the keys to remove
+ * @returns Number of keys removed
+ */
+size_t trie_delete_prefix(Trie* trie, const char* key_prefix);
+
+/**
+ * Delete every key starting with a prefix given the length of the prefix.
+ *
+ * @param trie Trie context
+ * @param key_prefix Bytes of the prefix of the keys to remove
+ * @param len Number of bytes in the prefix
+ * @returns Number of keys removed
+ */
+size_t trie_delete_prefix_n(Trie* trie, const void* key_prefix, size_t len);
+
+/**
+ * Move every key starting with a prefix under another prefix.
+ *
+ * Each key made of <code>from</code> followed by some suffix becomes the key
+ * made of <code>to</code> followed by the same suffix, keeping its value.
+ * The subtree holding the keys is detached and grafted back under the new
+ * prefix without copying keys, so that only the segments at its boundary
+ * are rewritten. Where keys already start with <code>to</code>, the two
+ * subtrees are merged, and moved values replace the values of the keys
+ * they land on, which are destroyed through the <code>dtor</code>
+ * operation.
+ *
+ * Memory is taken before any key moves. If it runs out, -1 is returned and
+ * the keys and values are left as they were, though the trie may keep extra
+ * nodes where it was split to make room for the subtree.
+ *
+ * @param trie Trie context
+ * @param from C-string prefix of the keys to move
+ * @param to C-string prefix replacing <code>from</code>
+ * @returns 0 on success or -1 on failure
+ */
+int trie_move_prefix(Trie* trie, const char* from, const char* to);
+
+/**
+ * Move every key starting with a prefix under another prefix, given the
+ * lengths of the prefixes.
+ *
+ * @param trie Trie context
+ * @param from Bytes of the prefix of the keys to move
+ * @param from_len Number of bytes in <code>from</code>
+ * @param to Bytes of the prefix replacing <code>from</code>
+ * @param to_len Number of bytes in <code>to</code>
+ * @returns 0 on success or -1 on failure
+ */
+int trie_move_prefix_n(Trie* trie, const void* from, size_t from_len,
+		       const void* to, size_t to_len);
+
+/**
+ * Function called by <code>trie_merge</code> on the two values of a key in
+ * both tries.
+ *
+ * It returns the value to keep, which may be either of the two or a new
+ * value, but not NULL. Each of the two values that is not returned is then
+ * destroyed through the <code>dtor</code> operation of the destination.
+ */
+typedef void* (*TrieResolver)(void* dst_value, void* src_value);
+
+/**
+ * Move all keys of a trie into another.
+ *
+ * Both tries are walked together: subtrees of <code>src</code> holding keys
+ * that <code>dst</code> does not have are spliced into <code>dst</code>
+ * whole, and only nodes where the tries overlap are merged, so that the
+ * result stays compact. If neither trie was created with
+ * <code>TRIE_ARENA</code>, the nodes of <code>src</code> change hands without
+ * being copied. Otherwise they are copied into the memory of
+ * <code>dst</code> first.
+ *
+ * Values of <code>src</code> move as they are and must suit the operations
+ * of <code>dst</code>. When both tries hold a key, the resolver picks its
+ * value, or the value from <code>src</code> is kept if the resolver is NULL.
+ * On success <code>src</code> is left empty.
+ *
+ * Memory is taken before any key moves. If it runs out, -1 is returned and
+ * both tries keep their keys and values, though they may keep extra nodes
+ * where they were split to line up with each other.
+ *
+ * @param dst Trie context receiving the keys
+ * @param src Trie context giving up its keys
+ * @param resolve Function choosing the value of keys in both tries, or NULL
+ * @returns 0 on success or -1 on failure
+ */
+int trie_merge(Trie* dst, Trie* src, TrieResolver resolve);
+
+/** Batch operation inserting a key-value pair. */
+#define TRIE_BATCH_INSERT 0
+
+/** Batch operation deleting a key. */
+#define TRIE_BATCH_DELETE 1
+
+/** Insertion or deletion applied by <code>trie_apply_batch</code>. */
+struct TrieBatchOp {
+	const void* key; /**< Bytes of the key. */
+	size_t len; /**< Number of bytes in the key. */
+	void* value; /**< Value to insert, ignored by deletions. */
+	int kind; /**< <code>TRIE_BATCH_INSERT</code> or
+		       <code>TRIE_BATCH_DELETE</code>. */
+	int result; /**< Set to the result of the matching single-key call. */
+};
+
+/**
+ * Apply a batch of insertions and deletions.
+ *
+ * The batch is sorted by key and applied in one pass, each key resuming the
+ * search below the prefix it shares with the previous one. Child vectors
+ * gaining several children are grown once for all of them. Ops on the same
+ * key are applied in their order in the batch, so the trie ends up as if
+ * the ops had been applied one by one with <code>trie_insert_n</code> and
+ * <code>trie_delete_n</code>, whose results are stored in each op.
+ *
+ * Batches pay off on tries too large for the cache, where the shared
+ * searches avoid most misses. On smaller tries, sorting costs more than it
+ * saves and single-key calls are faster.
+ *
+ * @param trie Trie context
+ * @param ops Operations to apply
+ * @param n Number of operations
+ * @returns Number of operations that failed
+ */
+size_t trie_apply_batch(Trie* trie, struct TrieBatchOp* ops, size_t n);
+
 /**
  * Find a value from the trie given it's key.
  *
@@ -113,17 +364,68 @@ int trie_delete(Trie* trie, char* key);
  */
 void* trie_find(Trie* trie, char* key);
 
+/**
+ * Find a value from the trie given it's key and the length of the key.
+ *
+ * @param trie Trie context
+ * @param key Bytes of the key the requested value was inserted with
+ * @param len Number of bytes in the key
+ * @returns Requested value or NULL if not found
+ */
+void* trie_find_n(Trie* trie, const void* key, size_t len);
+
+/**
+ * Find the values of many keys at once.
+ *
+ * The lookups are interleaved, so that the nodes each of them needs next are
+ * fetched from memory while the others advance. This gives much higher
+ * throughput than finding the keys one by one on tries that do not fit in
+ * cache.
+ *
+ * @param trie Trie context
+ * @param keys Keys the requested values were inserted with
+ * @param lens Number of bytes in each key, or NULL if keys are C-strings
+ * @param n Number of keys
+ * @param values Receives the value of each key, or NULL if not found
+ * @returns Number of keys found
+ */
+size_t trie_find_batch(Trie* trie, const char* const* keys, const size_t* lens,
+		       size_t n, void** values);
+
 /**
  * Get a rough estimate of the number of bytes used by the trie.
  *
  * Values will not be considered in the aggregate if the <code>memusage</code>
  * operation passed to <code>trie_create()</code> was a NULL function pointer.
+ * Each value is measured once when it is inserted and once when it is
+ * replaced or deleted, so it should not change size in between.
+ *
+ * The estimate is maintained by trie operations and takes constant time.
  *
  * @param trie Trie context
  * @returns Optimistic estimate of the number of bytes used.
  */
 size_t trie_memory_usage(const Trie* trie);
 
+/** Counters maintained by trie operations. */
+struct TrieStats {
+	size_t n_keys; /**< Number of keys in the trie. */
+	size_t n_nodes; /**< Number of nodes, including the root. */
+	size_t node_bytes; /**< Bytes requested for nodes and segments. */
+	size_t value_bytes; /**< Bytes used by values, as per memusage. */
+};
+
+/**
+ * Get the key count, node count and memory usage of a trie.
+ *
+ * Takes constant time. <code>node_bytes + value_bytes</code> equals the
+ * result of <code>trie_memory_usage</code>.
+ *
+ * @param trie Trie context
+ * @returns Current trie counters
+ */
+struct TrieStats trie_stats(const Trie* trie);
+
 
 //////////////////////////////////////////////////////////
 //////////////////// ITERATOR SECTION ////////////////////
@@ -144,6 +446,9 @@ typedef struct TrieIterator TrieIterator;
  */
 void trie_iter_destroy(TrieIterator* iter);
 
+/** Maximum key length accepted by iterators to enumerate keys of any length. */
+#define TRIE_KEYLEN_ANY ((size_t)-1)
+
 /**
  * Create an iterator to cover all keys with a given prefix and maximum size.
  *
@@ -155,8 +460,10 @@ void trie_iter_destroy(TrieIterator* iter);
  * <code>strcmp(key1, key2)</code> will be negative if <code>key1</code> is
  * enumerated before <code>key2</code>.
  *
- * Enumeration without a maximum length constraint can be done by passing the
- * return value of <code>trie_maxkeylen_added</code> in the third argument.
+ * Enumeration without a maximum length constraint can be done by passing
+ * <code>TRIE_KEYLEN_ANY</code> in the third argument. The key buffer of an
+ * iterator grows with the longest key enumerated so far, and subtrees whose
+ * keys all exceed the maximum length are not visited.
  *
  * @param trie Trie context
  * @param key_prefix C-string prefixing all keys to enumerate
@@ -165,6 +472,247 @@ void trie_iter_destroy(TrieIterator* iter);
  */
 TrieIterator* trie_findall(Trie* trie, const char* key_prefix, size_t max_len);
 
+/**
+ * Create an iterator given the length of the key prefix.
+ *
+ * Keys are compared byte by byte as unsigned characters, and a key is
+ * enumerated before all longer keys it prefixes. Keys containing zero bytes
+ * should be read with <code>trie_iter_getkeylen</code>.
+ *
+ * @param trie Trie context
+ * @param key_prefix Bytes prefixing all keys to enumerate
+ * @param len Number of bytes in the prefix
+ * @param max_len Upper bound on the lengths of the keys to enumerate
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_findall_n(Trie* trie, const void* key_prefix, size_t len,
+			     size_t max_len);
+
+/**
+ * Create an iterator positioned at the last key with a given prefix.
+ *
+ * The iterator covers the same keys as one created by
+ * <code>trie_findall</code>, but starts from the greatest of them, so that
+ * <code>trie_iter_prev</code> enumerates them in descending order. Reaching
+ * the last k keys takes time proportional to k and the depth of the trie.
+ *
+ * @param trie Trie context
+ * @param key_prefix C-string prefixing all keys to enumerate
+ * @param max_len Upper bound on the lengths of the keys to enumerate
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_findlast(Trie* trie, const char* key_prefix,
+			    size_t max_len);
+
+/**
+ * Create an iterator positioned at the last key given the length of the key
+ * prefix.
+ *
+ * @param trie Trie context
+ * @param key_prefix Bytes prefixing all keys to enumerate
+ * @param len Number of bytes in the prefix
+ * @param max_len Upper bound on the lengths of the keys to enumerate
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_findlast_n(Trie* trie, const void* key_prefix, size_t len,
+			      size_t max_len);
+
+/**
+ * Create an iterator positioned at the smallest key not less than a given
+ * key.
+ *
+ * The iterator covers every key of the trie: advancing it enumerates all
+ * keys greater than the first one in ascending order, and moving it back
+ * enumerates the smaller ones. Positioning takes time proportional to the
+ * length of the key, so a scan can be resumed from the last key seen
+ * without enumerating the keys before it.
+ *
+ * NULL will be returned either if the amount of free memory required is not
+ * available or if all keys are less than the given key.
+ *
+ * @param trie Trie context
+ * @param key C-string to position the iterator at
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_seek(Trie* trie, const char* key);
+
+/**
+ * Create an iterator positioned at the smallest key not less than a given
+ * key, given the length of the key.
+ *
+ * @param trie Trie context
+ * @param key Bytes to position the iterator at
+ * @param len Number of bytes in the key
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_seek_n(Trie* trie, const void* key, size_t len);
+
+/**
+ * Create an iterator positioned at the smallest key greater than a given key.
+ *
+ * Behaves like <code>trie_seek</code>, except that the given key itself is
+ * skipped.
+ *
+ * @param trie Trie context
+ * @param key C-string to position the iterator after
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_upper_bound(Trie* trie, const char* key);
+
+/**
+ * Create an iterator positioned at the smallest key greater than a given key,
+ * given the length of the key.
+ *
+ * @param trie Trie context
+ * @param key Bytes to position the iterator after
+ * @param len Number of bytes in the key
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_upper_bound_n(Trie* trie, const void* key, size_t len);
+
+/**
+ * Create an iterator to cover all keys in a half-open range.
+ *
+ * Keys not less than <code>lo</code> and less than <code>hi</code> are
+ * enumerated in ascending order, starting from the smallest of them. Only
+ * subtrees overlapping the range are visited, and the iterator ends as soon
+ * as it reaches a key not less than <code>hi</code>.
+ *
+ * NULL will be returned either if the amount of free memory required is not
+ * available or if no key lies in the range.
+ *
+ * @param trie Trie context
+ * @param lo C-string lower bound, inclusive
+ * @param hi C-string upper bound, exclusive
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_range(Trie* trie, const char* lo, const char* hi);
+
+/**
+ * Create an iterator to cover all keys in a half-open range given the
+ * lengths of the bounds.
+ *
+ * @param trie Trie context
+ * @param lo Bytes of the lower bound, inclusive
+ * @param lo_len Number of bytes in the lower bound
+ * @param hi Bytes of the upper bound, exclusive
+ * @param hi_len Number of bytes in the upper bound
+ * @returns Valid iterator or NULL
+ */
+TrieIterator* trie_range_n(Trie* trie, const void* lo, size_t lo_len,
+			   const void* hi, size_t hi_len);
+
+/**
+ * Function called on every (key, value) pair visited by
+ * <code>trie_foreach</code>.
+ *
+ * The key is borrowed from the trie walk: it is followed by a zero byte and
+ * remains valid only until the visitor returns. A nonzero result stops the
+ * walk.
+ */
+typedef int (*TrieVisitor)(const char* key, size_t keylen, void* value,
+			   void* ctx);
+
+/**
+ * Call a visitor on all keys with a given prefix.
+ *
+ * Keys are visited in the same order as by <code>trie_findall</code>. The
+ * walk maintains one key buffer, extending it by a segment per node instead
+ * of copying each key, and does not allocate an iterator.
+ *
+ * @param trie Trie context
+ * @param key_prefix C-string prefixing all keys to visit
+ * @param visitor Function called on each (key, value) pair
+ * @param ctx Context passed to the visitor
+ * @returns 0 if all keys were visited, 1 if the visitor stopped the walk or -1
+ *          if out of memory
+ */
+int trie_foreach(Trie* trie, const char* key_prefix, TrieVisitor visitor,
+		 void* ctx);
+
+/**
+ * Call a visitor on all keys with a prefix given its length.
+ *
+ * @param trie Trie context
+ * @param key_prefix Bytes prefixing all keys to visit
+ * @param len Number of bytes in the prefix
+ * @param visitor Function called on each (key, value) pair
+ * @param ctx Context passed to the visitor
+ * @returns 0 if all keys were visited, 1 if the visitor stopped the walk or -1
+ *          if out of memory
+ */
+int trie_foreach_n(Trie* trie, const void* key_prefix, size_t len,
+		   TrieVisitor visitor, void* ctx);
+
+/**
+ * Call a visitor on the values of all keys with a given prefix.
+ *
+ * Keys are not built: the visitor receives a NULL key along with the length
+ * of the key, which makes this the cheapest way to scan values.
+ *
+ * @param trie Trie context
+ * @param key_prefix C-string prefixing all keys to visit
+ * @param visitor Function called on each value
+ * @param ctx Context passed to the visitor
+ * @returns 0 if all values were visited, 1 if the visitor stopped the walk
+ *          or -1 if out of memory
+ */
+int trie_foreach_value(Trie* trie, const char* key_prefix,
+		       TrieVisitor visitor, void* ctx);
+
+/**
+ * Call a visitor on the values of all keys with a prefix given its length.
+ *
+ * @param trie Trie context
+ * @param key_prefix Bytes prefixing all keys to visit
+ * @param len Number of bytes in the prefix
+ * @param visitor Function called on each value
+ * @param ctx Context passed to the visitor
+ * @returns 0 if all values were visited, 1 if the visitor stopped the walk
+ *          or -1 if out of memory
+ */
+int trie_foreach_value_n(Trie* trie, const void* key_prefix, size_t len,
+			 TrieVisitor visitor, void* ctx);
+
+/**
+ * Split the keys with a given prefix among several iterators.
+ *
+ * The keys are cut at node boundaries into at most <code>n</code> disjoint
+ * pieces holding similar numbers of subtrees. The cut is made at the first
+ * level of the subtrie with enough nodes, below any prefix that all of its
+ * keys share. An iterator over each piece is stored in <code>iters</code>
+ * in ascending order. Each iterator enumerates its own keys in ascending order
+ * and ends where the next piece starts, so enumerating the pieces one after
+ * the other yields the keys in the order of <code>trie_findall</code>.
+ * Pieces holding no keys are left out.
+ *
+ * Iterators only read the trie, so the pieces can be enumerated by separate
+ * threads as long as the trie is not modified meanwhile.
+ *
+ * @param trie Trie context
+ * @param key_prefix C-string prefixing all keys to split
+ * @param iters Array receiving up to <code>n</code> iterators
+ * @param n Maximum number of pieces
+ * @returns Number of iterators stored, or 0 if there are no keys with the
+ *          prefix or if out of memory
+ */
+size_t trie_split(Trie* trie, const char* key_prefix, TrieIterator** iters,
+		  size_t n);
+
+/**
+ * Split the keys with a prefix given its length among several iterators.
+ *
+ * @param trie Trie context
+ * @param key_prefix Bytes prefixing all keys to split
+ * @param len Number of bytes in the prefix
+ * @param iters Array receiving up to <code>n</code> iterators
+ * @param n Maximum number of pieces
+ * @returns Number of iterators stored, or 0 if there are no keys with the
+ *          prefix or if out of memory
+ */
+size_t trie_split_n(Trie* trie, const void* key_prefix, size_t len,
+		    TrieIterator** iters, size_t n);
+
 /**
  * Advance an iterator to the next valid (key, value) pair.
  *
@@ -178,6 +726,18 @@ TrieIterator* trie_findall(Trie* trie, const char* key_prefix, size_t max_len);
  */
 void trie_iter_next(TrieIterator** iter_p);
 
+/**
+ * Move an iterator back to the previous valid (key, value) pair.
+ *
+ * Calls to <code>trie_iter_next</code> and <code>trie_iter_prev</code> may be
+ * interleaved freely. Moving back from the first key invalidates the
+ * iterator in the same way as advancing past the last key. Iterators over a
+ * range do not move back past the lower bound.
+ *
+ * @param iter_p Pointer to valid iterator or NULL
+ */
+void trie_iter_prev(TrieIterator** iter_p);
+
 /**
  * Get the key at the current iterator.
  *
@@ -189,6 +749,17 @@ void trie_iter_next(TrieIterator** iter_p);
  */
 const char* trie_iter_getkey(const TrieIterator* iter);
 
+/**
+ * Get the length of the key at the current iterator.
+ *
+ * The key returned by <code>trie_iter_getkey</code> is always followed by a
+ * zero byte, which is not counted.
+ *
+ * @param iter Current iterator
+ * @returns Number of bytes in the iterator key or 0 if the iterator is invalid
+ */
+size_t trie_iter_getkeylen(const TrieIterator* iter);
+
 /**
  * Get the value at the current iterator.
  *
@@ -198,4 +769,69 @@ const char* trie_iter_getkey(const TrieIterator* iter);
 void* trie_iter_getval(const TrieIterator* iter);
 
 
+
+////////////////////////////////////////////////////////
+//////////////////// WALKER SECTION ////////////////////
+////////////////////////////////////////////////////////
+
+/** A key ends at the current walker position. */
+#define TRIE_WALK_VALUE 0x1u
+
+/** Some longer key starts with the bytes fed so far. */
+#define TRIE_WALK_MORE 0x2u
+
+/**
+ * Position of a lookup fed one byte or one chunk at a time.
+ *
+ * Walkers live in storage provided by the caller and never allocate. Their
+ * fields are private. Behavior of a walker, after any trie modification, is
+ * undefined.
+ */
+struct TrieWalker {
+	const struct TrieNode* node; /**< Node holding the position. */
+	size_t segpos; /**< Bytes of the node segment matched. */
+};
+
+/**
+ * Position a walker at the empty key.
+ *
+ * @param walker Walker to initialize
+ * @param trie Trie context
+ * @returns Walker state, as per <code>trie_walker_feed</code>
+ */
+unsigned trie_walker_init(struct TrieWalker* walker, const Trie* trie);
+
+/**
+ * Advance a walker by one byte.
+ *
+ * @param walker Initialized walker
+ * @param byte Next key byte
+ * @returns Walker state, as per <code>trie_walker_feed</code>
+ */
+unsigned trie_walker_step(struct TrieWalker* walker, unsigned char byte);
+
+/**
+ * Advance a walker by a chunk of bytes.
+ *
+ * Once no key starts with the bytes fed, the walker stays at a dead end and
+ * the state returned is 0, so unknown keys can be rejected without reading
+ * them further.
+ *
+ * @param walker Initialized walker
+ * @param bytes Next key bytes
+ * @param len Number of bytes
+ * @returns Bitwise OR of <code>TRIE_WALK_VALUE</code> and
+ *          <code>TRIE_WALK_MORE</code>, or 0 at a dead end
+ */
+unsigned trie_walker_feed(struct TrieWalker* walker, const void* bytes,
+			  size_t len);
+
+/**
+ * Get the value of the key made of the bytes fed to a walker.
+ *
+ * @param walker Initialized walker
+ * @returns Value or NULL if the bytes fed are not a key
+ */
+void* trie_walker_value(const struct TrieWalker* walker);
+
 #endif /* TRIE */
@@ -0,0 +1,565 @@
+#include "trie.c"
+#include "pool.c"
+
+#include <stdio.h>
+#include <time.h>
+
+
+#define N_KEYS 4096
+#define N_ROUNDS 64
+
+#ifdef TRIE_NO_SIMD
+#define BENCH_MODE "byte-wise"
+#else
+#define BENCH_MODE "word-wise"
+#endif
+
+
+static void fill_rand(char* buf, size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+		buf[i] = (char)('a' + rand() % 26);
+}
+
+
+/* Keys share a prefix of prefix_len bytes and differ in the rest */
+static void bench_find(const char* name, size_t prefix_len, size_t keylen,
+		       unsigned flags)
+{
+	char** keys = malloc(N_KEYS * sizeof keys[0]);
+	Trie* trie = trie_create_flags(TRIE_OPS_NONE, flags);
+	for (size_t i = 0; i < N_KEYS; ++i) {
+		keys[i] = malloc(keylen + 1);
+		if (i == 0)
+			fill_rand(keys[i], prefix_len);
+		else
+			memcpy(keys[i], keys[0], prefix_len);
+		fill_rand(keys[i] + prefix_len, keylen - prefix_len);
+		keys[i][keylen] = '\0';
+		trie_insert_n(trie, keys[i], keylen, keys[i]);
+	}
+
+	size_t n_found = 0;
+	clock_t start = clock();
+	for (size_t round = 0; round < N_ROUNDS; ++round)
+		for (size_t i = 0; i < N_KEYS; ++i)
+			n_found += trie_find_n(trie, keys[i], keylen) != NULL;
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-10s %-24s %8.1f ns/find (%zu found)\n", BENCH_MODE, name,
+	       secs * 1e9 / (N_ROUNDS * N_KEYS), n_found);
+
+	trie_destroy(trie);
+	for (size_t i = 0; i < N_KEYS; ++i)
+		free(keys[i]);
+	free(keys);
+}
+
+
+/* Full scans of a trie of random keys */
+static void bench_iter(const char* name, size_t keylen)
+{
+	char* key = malloc(keylen + 1);
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	for (size_t i = 0; i < N_KEYS; ++i) {
+		fill_rand(key, keylen);
+		trie_insert_n(trie, key, keylen, trie);
+	}
+
+	size_t n_found = 0;
+	clock_t start = clock();
+	for (size_t round = 0; round < N_ROUNDS; ++round) {
+		TrieIterator* iter = trie_findall(trie, "", keylen);
+		for (; iter; trie_iter_next(&iter))
+			++n_found;
+	}
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-10s %-24s %8.1f ns/key (%zu found)\n", BENCH_MODE, name,
+	       secs * 1e9 / (double)n_found, n_found);
+
+	trie_destroy(trie);
+	free(key);
+}
+
+
+static int count_visit(const char* key, size_t keylen, void* value,
+		       void* ctx)
+{
+	(void)key, (void)keylen, (void)value;
+	++*(size_t*)ctx;
+	return 0;
+}
+
+
+static void bench_foreach(const char* name, size_t keylen, bool with_keys)
+{
+	char* key = malloc(keylen + 1);
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	for (size_t i = 0; i < N_KEYS; ++i) {
+		fill_rand(key, keylen);
+		trie_insert_n(trie, key, keylen, trie);
+	}
+
+	size_t n_found = 0;
+	clock_t start = clock();
+	for (size_t round = 0; round < N_ROUNDS; ++round) {
+		if (with_keys)
+			trie_foreach(trie, "", count_visit, &n_found);
+		else
+			trie_foreach_value(trie, "", count_visit, &n_found);
+	}
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-10s %-24s %8.1f ns/key (%zu found)\n", BENCH_MODE, name,
+	       secs * 1e9 / (double)n_found, n_found);
+
+	trie_destroy(trie);
+	free(key);
+}
+
+
+static int cmp_keys(const void* key1, const void* key2)
+{
+	return strcmp(*(char* const*)key1, *(char* const*)key2);
+}
+
+
+/* Loading sorted keys by insertion and in bulk */
+static void bench_build(const char* name, size_t keylen)
+{
+	char** keys = malloc(N_KEYS * sizeof keys[0]);
+	for (size_t i = 0; i < N_KEYS; ++i) {
+		keys[i] = malloc(keylen + 1);
+		fill_rand(keys[i], keylen);
+		keys[i][keylen] = '\0';
+	}
+	qsort(keys, N_KEYS, sizeof keys[0], cmp_keys);
+	size_t n_keys = 0;
+	for (size_t i = 0; i < N_KEYS; ++i) {
+		if (n_keys && strcmp(keys[n_keys - 1], keys[i]) == 0)
+			free(keys[i]);
+		else
+			keys[n_keys++] = keys[i];
+	}
+
+	clock_t start = clock();
+	for (size_t round = 0; round < N_ROUNDS; ++round) {
+		Trie* trie = trie_create(TRIE_OPS_NONE);
+		for (size_t i = 0; i < n_keys; ++i)
+			trie_insert_n(trie, keys[i], keylen, keys[i]);
+		trie_destroy(trie);
+	}
+	double insert_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (size_t round = 0; round < N_ROUNDS; ++round)
+		trie_destroy(trie_build_sorted(TRIE_OPS_NONE, 0,
+					       (const char* const*)keys, NULL,
+					       (void* const*)keys, n_keys));
+	double build_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-10s %-24s %8.1f ns/key insert, %.1f ns/key bulk\n",
+	       BENCH_MODE, name, insert_secs * 1e9 / (N_ROUNDS * n_keys),
+	       build_secs * 1e9 / (N_ROUNDS * n_keys));
+
+	for (size_t i = 0; i < n_keys; ++i)
+		free(keys[i]);
+	free(keys);
+}
+
+
+/* Times adding ops to a trie of n_keys keys on a trie of its own, built right
+ * before, so that it reuses no memory freed by the other way of adding them */
+static double time_inserts(const char* keys, struct TrieBatchOp* ops,
+			   size_t keylen, size_t n_keys, size_t n_ops,
+			   bool batched)
+{
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	for (size_t i = 0; i < n_keys; ++i)
+		trie_insert_n(trie, keys + i * keylen, keylen, ops[0].value);
+
+	clock_t start = clock();
+	if (batched)
+		trie_apply_batch(trie, ops, n_ops);
+	else
+		for (size_t i = 0; i < n_ops; ++i)
+			trie_insert_n(trie, ops[i].key, ops[i].len,
+				      ops[i].value);
+	double secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	trie_destroy(trie);
+	return secs;
+}
+
+
+/* Inserting a batch of n_ops random keys into a trie of n_keys keys, one by
+ * one and as a batch */
+static void bench_batch(const char* name, size_t prefix_len, size_t keylen,
+			size_t n_keys, size_t n_ops)
+{
+	char* keys = malloc((n_keys + n_ops) * keylen);
+	struct TrieBatchOp* ops = malloc(n_ops * sizeof ops[0]);
+	fill_rand(keys, prefix_len);
+	for (size_t i = 0; i < n_keys + n_ops; ++i) {
+		memcpy(keys + i * keylen, keys, prefix_len);
+		fill_rand(keys + i * keylen + prefix_len, keylen - prefix_len);
+	}
+	for (size_t i = 0; i < n_ops; ++i) {
+		ops[i].key = keys + (n_keys + i) * keylen;
+		ops[i].len = keylen;
+		ops[i].value = keys;
+		ops[i].kind = TRIE_BATCH_INSERT;
+	}
+
+	/* Serial and batched insertion go first in turn */
+	size_t n_rounds = N_ROUNDS * N_KEYS / (4 * n_ops);
+	if (n_rounds < 2)
+		n_rounds = 2;
+	double secs[2] = { 0, 0 };
+	for (size_t round = 0; round < n_rounds; ++round) {
+		bool batched = round & 1;
+		secs[batched] += time_inserts(keys, ops, keylen, n_keys, n_ops,
+					      batched);
+		secs[!batched] += time_inserts(keys, ops, keylen, n_keys,
+					       n_ops, !batched);
+	}
+
+	printf("%-10s %-24s %8.1f ns/key serial, %.1f ns/key batch\n",
+	       BENCH_MODE, name, secs[0] * 1e9 / (n_rounds * n_ops),
+	       secs[1] * 1e9 / (n_rounds * n_ops));
+
+	free(ops);
+	free(keys);
+}
+
+
+/* Counting occurrences of random keys, each seen twice on average, with a
+ * lookup followed by an insertion on a miss and with one upsert */
+static void bench_upsert(const char* name, size_t keylen)
+{
+	char* keys = malloc(N_KEYS * keylen);
+	size_t* counts = malloc(N_KEYS * sizeof counts[0]);
+	const char** stream = malloc(2 * N_KEYS * sizeof stream[0]);
+	fill_rand(keys, N_KEYS * keylen);
+	for (size_t i = 0; i < 2 * N_KEYS; ++i)
+		stream[i] = keys + (size_t)rand() % N_KEYS * keylen;
+
+	double find_secs = 0, upsert_secs = 0;
+	for (size_t round = 0; round < N_ROUNDS / 4; ++round) {
+		Trie *found = trie_create(TRIE_OPS_NONE),
+		     *upserted = trie_create(TRIE_OPS_NONE);
+		clock_t start = clock();
+		for (size_t i = 0; i < 2 * N_KEYS; ++i) {
+			size_t* count = (size_t*)trie_find_n(found, stream[i],
+							    keylen);
+			if (!count) {
+				count = &counts[(size_t)(stream[i] - keys)
+						/ keylen];
+				*count = 0;
+				trie_insert_n(found, stream[i], keylen, count);
+			}
+			++*count;
+		}
+		find_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		start = clock();
+		for (size_t i = 0; i < 2 * N_KEYS; ++i) {
+			int inserted;
+			void** slot = trie_upsert_n(upserted, stream[i],
+						    keylen, &inserted);
+			if (inserted) {
+				*slot = &counts[(size_t)(stream[i] - keys)
+						/ keylen];
+				*(size_t*)*slot = 0;
+			}
+			++*(size_t*)*slot;
+		}
+		upsert_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		trie_destroy(found);
+		trie_destroy(upserted);
+	}
+
+	printf("%-10s %-24s %8.1f ns/key find+insert, %.1f ns/key upsert\n",
+	       BENCH_MODE, name,
+	       find_secs * 1e9 / (N_ROUNDS / 4 * 2 * N_KEYS),
+	       upsert_secs * 1e9 / (N_ROUNDS / 4 * 2 * N_KEYS));
+
+	free(keys);
+	free(counts);
+	free(stream);
+}
+
+
+/* Evicting every tenant of a trie whose keys start with one of 64 tenant
+ * prefixes, key by key through an iterator and as prefixes */
+static void bench_delete_prefix(const char* name, size_t keylen)
+{
+	const size_t n_tenants = 64, prefix_len = 8;
+	char* keys = malloc(N_KEYS * keylen);
+	char** found = malloc(N_KEYS * sizeof found[0]);
+	fill_rand(keys, N_KEYS * keylen);
+	for (size_t i = 0; i < N_KEYS; ++i)
+		memcpy(keys + i * keylen, keys + i % n_tenants * keylen,
+		       prefix_len);
+
+	double scan_secs = 0, prefix_secs = 0;
+	for (size_t round = 0; round < N_ROUNDS / 4; ++round) {
+		Trie *scanned = trie_create(TRIE_OPS_NONE),
+		     *pruned = trie_create(TRIE_OPS_NONE);
+		for (size_t i = 0; i < N_KEYS; ++i) {
+			trie_insert_n(scanned, keys + i * keylen, keylen, keys);
+			trie_insert_n(pruned, keys + i * keylen, keylen, keys);
+		}
+
+		clock_t start = clock();
+		for (size_t t = 0; t < n_tenants; ++t) {
+			size_t n_found = 0;
+			TrieIterator* it = trie_findall_n(scanned,
+							  keys + t * keylen,
+							  prefix_len,
+							  TRIE_KEYLEN_ANY);
+			for (; it; trie_iter_next(&it))
+				found[n_found++] = add_strs(NULL,
+					trie_iter_getkey(it),
+					trie_iter_getkeylen(it), "", 0);
+			for (size_t i = 0; i < n_found; ++i) {
+				trie_delete_n(scanned, found[i], keylen);
+				free(found[i]);
+			}
+		}
+		scan_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		start = clock();
+		for (size_t t = 0; t < n_tenants; ++t)
+			trie_delete_prefix_n(pruned, keys + t * keylen,
+					     prefix_len);
+		prefix_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		trie_destroy(scanned);
+		trie_destroy(pruned);
+	}
+
+	printf("%-10s %-24s %8.1f ns/key scan+delete, %.1f ns/key prefix\n",
+	       BENCH_MODE, name, scan_secs * 1e9 / (N_ROUNDS / 4 * N_KEYS),
+	       prefix_secs * 1e9 / (N_ROUNDS / 4 * N_KEYS));
+
+	free(keys);
+	free(found);
+}
+
+
+/* Renaming the tenant prefixes of keys by reinserting every key against
+ * moving the subtrees of the prefixes */
+static void bench_move_prefix(const char* name, size_t keylen)
+{
+	const size_t n_tenants = 64, prefix_len = 8;
+	char* keys = malloc(N_KEYS * keylen);
+	char* renamed = malloc(n_tenants * prefix_len);
+	char** found = malloc(N_KEYS * sizeof found[0]);
+	fill_rand(keys, N_KEYS * keylen);
+	fill_rand(renamed, n_tenants * prefix_len);
+	for (size_t i = 0; i < N_KEYS; ++i)
+		memcpy(keys + i * keylen, keys + i % n_tenants * keylen,
+		       prefix_len);
+
+	double scan_secs = 0, move_secs = 0;
+	for (size_t round = 0; round < N_ROUNDS / 4; ++round) {
+		Trie *scanned = trie_create(TRIE_OPS_NONE),
+		     *grafted = trie_create(TRIE_OPS_NONE);
+		for (size_t i = 0; i < N_KEYS; ++i) {
+			trie_insert_n(scanned, keys + i * keylen, keylen, keys);
+			trie_insert_n(grafted, keys + i * keylen, keylen, keys);
+		}
+
+		clock_t start = clock();
+		for (size_t t = 0; t < n_tenants; ++t) {
+			size_t n_found = 0;
+			TrieIterator* it = trie_findall_n(scanned,
+							  keys + t * keylen,
+							  prefix_len,
+							  TRIE_KEYLEN_ANY);
+			for (; it; trie_iter_next(&it))
+				found[n_found++] = add_strs(NULL,
+					trie_iter_getkey(it),
+					trie_iter_getkeylen(it), "", 0);
+			for (size_t i = 0; i < n_found; ++i) {
+				trie_delete_n(scanned, found[i], keylen);
+				memcpy(found[i], renamed + t * prefix_len,
+				       prefix_len);
+				trie_insert_n(scanned, found[i], keylen, keys);
+				free(found[i]);
+			}
+		}
+		scan_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		start = clock();
+		for (size_t t = 0; t < n_tenants; ++t)
+			trie_move_prefix_n(grafted, keys + t * keylen,
+					   prefix_len, renamed + t * prefix_len,
+					   prefix_len);
+		move_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		trie_destroy(scanned);
+		trie_destroy(grafted);
+	}
+
+	printf("%-10s %-24s %8.1f ns/key reinsert, %.1f ns/key move\n",
+	       BENCH_MODE, name, scan_secs * 1e9 / (N_ROUNDS / 4 * N_KEYS),
+	       move_secs * 1e9 / (N_ROUNDS / 4 * N_KEYS));
+
+	free(keys);
+	free(renamed);
+	free(found);
+}
+
+
+/* Combining two tries of random keys by inserting the keys of one into the
+ * other against merging their structures */
+static void bench_merge(const char* name, size_t keylen)
+{
+	char* keys = malloc(N_KEYS * keylen);
+	fill_rand(keys, N_KEYS * keylen);
+
+	double insert_secs = 0, merge_secs = 0;
+	for (size_t round = 0; round < N_ROUNDS / 4; ++round) {
+		Trie *copied = trie_create(TRIE_OPS_NONE),
+		     *merged = trie_create(TRIE_OPS_NONE),
+		     *src1 = trie_create(TRIE_OPS_NONE),
+		     *src2 = trie_create(TRIE_OPS_NONE);
+		for (size_t i = 0; i < N_KEYS / 2; ++i) {
+			trie_insert_n(copied, keys + i * keylen, keylen, keys);
+			trie_insert_n(merged, keys + i * keylen, keylen, keys);
+		}
+		for (size_t i = N_KEYS / 2; i < N_KEYS; ++i) {
+			trie_insert_n(src1, keys + i * keylen, keylen, keys);
+			trie_insert_n(src2, keys + i * keylen, keylen, keys);
+		}
+
+		clock_t start = clock();
+		TrieIterator* it = trie_findall(src1, "", TRIE_KEYLEN_ANY);
+		for (; it; trie_iter_next(&it))
+			trie_insert_n(copied, trie_iter_getkey(it),
+				      trie_iter_getkeylen(it),
+				      trie_iter_getval(it));
+		insert_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		start = clock();
+		trie_merge(merged, src2, NULL);
+		merge_secs += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+		trie_destroy(copied);
+		trie_destroy(merged);
+		trie_destroy(src1);
+		trie_destroy(src2);
+	}
+
+	printf("%-10s %-24s %8.1f ns/key insert, %.1f ns/key merge\n",
+	       BENCH_MODE, name,
+	       insert_secs * 1e9 / (N_ROUNDS / 4 * (N_KEYS / 2)),
+	       merge_secs * 1e9 / (N_ROUNDS / 4 * (N_KEYS / 2)));
+
+	free(keys);
+}
+
+
+/* Lookups of random keys of a trie much larger than the cache, one by one
+ * and in batches of batch_size keys */
+static void bench_find_batch(const char* name, size_t n_keys,
+			     size_t batch_size)
+{
+	const size_t keylen = 16;
+	char* keys = malloc(n_keys * keylen);
+	const char** order = malloc(n_keys * sizeof order[0]);
+	size_t* lens = malloc(n_keys * sizeof lens[0]);
+	void** values = malloc(n_keys * sizeof values[0]);
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	fill_rand(keys, n_keys * keylen);
+	for (size_t i = 0; i < n_keys; ++i) {
+		trie_insert_n(trie, keys + i * keylen, keylen, keys);
+		order[i] = keys + (size_t)rand() % n_keys * keylen;
+		lens[i] = keylen;
+	}
+
+	size_t n_serial = 0, n_batch = 0;
+	clock_t start = clock();
+	for (size_t round = 0; round < 4; ++round)
+		for (size_t i = 0; i < n_keys; ++i)
+			n_serial += trie_find_n(trie, order[i], keylen) != NULL;
+	double serial_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	for (size_t round = 0; round < 4; ++round)
+		for (size_t i = 0; i < n_keys; i += batch_size)
+			n_batch += trie_find_batch(trie, order + i, lens + i,
+						   n_keys - i < batch_size
+						   ? n_keys - i : batch_size,
+						   values + i);
+	double batch_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-10s %-24s %8.1f ns/find serial, %.1f ns/find batch "
+	       "(%zu found)\n", BENCH_MODE, name,
+	       serial_secs * 1e9 / (4 * n_keys),
+	       batch_secs * 1e9 / (4 * n_keys), n_batch);
+
+	trie_destroy(trie);
+	free(keys);
+	free(order);
+	free(lens);
+	free(values);
+	(void)n_serial;
+}
+
+
+/* Memory usage and destruction of a trie holding every prefix of one key */
+static void bench_walk(const char* name, size_t depth)
+{
+	char* key = malloc(depth);
+	fill_rand(key, depth);
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	for (size_t len = 1; len <= depth; ++len)
+		trie_insert_n(trie, key, len, key);
+
+	size_t usage = 0;
+	clock_t start = clock();
+	for (size_t round = 0; round < N_ROUNDS; ++round)
+		usage += trie_memory_usage(trie);
+	double usage_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	start = clock();
+	trie_destroy(trie);
+	double destroy_secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	printf("%-10s %-24s %8.1f ns/node usage, %.1f ns/node destroy "
+	       "(%zu bytes)\n", BENCH_MODE, name,
+	       usage_secs * 1e9 / (N_ROUNDS * depth),
+	       destroy_secs * 1e9 / depth, usage / N_ROUNDS);
+	free(key);
+}
+
+
+int main(void)
+{
+	srand(1);
+	bench_find("short keys (16 bytes)", 0, 16, 0);
+	bench_find("short keys, root table", 0, 16, TRIE_ROOT_TABLE);
+	bench_find("long keys (128 bytes)", 0, 128, 0);
+	bench_find("shared prefix (96+64)", 96, 160, 0);
+	bench_find("shared prefix (512+64)", 512, 576, 0);
+	bench_iter("iterate (16 bytes)", 16);
+	bench_foreach("foreach (16 bytes)", 16, true);
+	bench_foreach("foreach values", 16, false);
+	bench_build("sorted load (16 bytes)", 16);
+	bench_batch("batch insert (16 bytes)", 0, 16, N_KEYS, N_KEYS);
+	bench_batch("batch insert (96+16)", 96, 112, N_KEYS, N_KEYS);
+	bench_batch("batch 64K into 256K", 0, 16, 1 << 18, 1 << 16);
+	bench_batch("batch 64K into 256K (96)", 96, 112, 1 << 18, 1 << 16);
+	bench_upsert("count keys (16 bytes)", 16);
+	bench_delete_prefix("evict tenants (8+16)", 24);
+	bench_move_prefix("rename tenants (8+16)", 24);
+	bench_merge("merge halves (16 bytes)", 16);
+	bench_find_batch("batch find (256 keys)", 1 << 20, 256);
+	bench_walk("deep trie (20000 levels)", 20000);
+	return 0;
+}
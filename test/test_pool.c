@@ -0,0 +1,150 @@
+#include "pool.c"
+
+#include "ctest.h"
+
+
+TEST_DEFINE(test_pool_alloc, res)
+{
+	TEST_AUTONAME(res);
+
+	Pool* p = pool_create(POOL_CHUNK_SIZE);
+	size_t n_blocks = (rand() % 1000) + 1000;
+	unsigned char** blocks = malloc(n_blocks * sizeof blocks[0]);
+	size_t* sizes = malloc(n_blocks * sizeof sizes[0]);
+
+	bool aligned = true;
+	for (size_t i = 0; i < n_blocks; ++i) {
+		sizes[i] = (size_t)(rand() % 2000);
+		blocks[i] = pool_alloc(p, sizes[i]);
+		memset(blocks[i], (int)(i & 0xFF), sizes[i]);
+		aligned = aligned && ((size_t)blocks[i] & 7) == 0;
+	}
+	bool intact = true;
+	for (size_t i = 0; i < n_blocks; ++i)
+		for (size_t j = 0; j < sizes[i]; ++j)
+			if (blocks[i][j] != (unsigned char)(i & 0xFF))
+				intact = false;
+	test_check(res, "Blocks are aligned", aligned);
+	test_check(res, "Blocks do not overlap", intact);
+
+	free(blocks);
+	free(sizes);
+	pool_destroy(p);
+}
+
+
+TEST_DEFINE(test_pool_reuse, res)
+{
+	TEST_AUTONAME(res);
+
+	Pool* p = pool_create(POOL_CHUNK_SIZE);
+	size_t size = (size_t)(rand() % 200) + 1;
+
+	void* block = pool_alloc(p, size);
+	pool_free(p, block, size);
+	test_check(res, "Freed block is reused", pool_alloc(p, size) == block);
+
+	void* large = pool_alloc(p, 100000);
+	pool_free(p, large, 100000);
+	pool_free(p, NULL, 0);
+
+	pool_destroy(p);
+}
+
+
+TEST_DEFINE(test_pool_null, res)
+{
+	TEST_AUTONAME(res);
+
+	void* block = pool_alloc(NULL, 100);
+	test_check(res, "NULL pool forwards to malloc", block != NULL);
+	pool_free(NULL, block, 100);
+	pool_destroy(NULL);
+}
+
+
+TEST_DEFINE(test_pool_in_use, res)
+{
+	TEST_AUTONAME(res);
+
+	Pool* p = rand() & 1 ? pool_create(POOL_CHUNK_SIZE)
+			     : pool_create_heap();
+	size_t n_blocks = (rand() % 100) + 100, total = 0;
+	void** blocks = malloc(n_blocks * sizeof blocks[0]);
+	size_t* sizes = malloc(n_blocks * sizeof sizes[0]);
+
+	for (size_t i = 0; i < n_blocks; ++i) {
+		sizes[i] = (size_t)(rand() % 2000);
+		blocks[i] = pool_alloc(p, sizes[i]);
+		total += sizes[i];
+	}
+	test_check(res, "Allocated bytes are counted", pool_in_use(p) == total);
+
+	for (size_t i = 0; i < n_blocks; i += 2) {
+		pool_free(p, blocks[i], sizes[i]);
+		total -= sizes[i];
+	}
+	test_check(res, "Freed bytes are uncounted", pool_in_use(p) == total);
+
+	for (size_t i = 1; i < n_blocks; i += 2)
+		pool_free(p, blocks[i], sizes[i]);
+	test_check(res, "NULL pool counts nothing", pool_in_use(NULL) == 0);
+
+	free(blocks);
+	free(sizes);
+	pool_destroy(p);
+}
+
+
+TEST_DEFINE(test_pool_adopt, res)
+{
+	TEST_AUTONAME(res);
+
+	Pool* owner = pool_create_heap();
+	Pool* heir = pool_create_heap();
+	Pool* chunked = pool_create(POOL_CHUNK_SIZE);
+	size_t size = (size_t)(rand() % 2000) + 1;
+	void* block = pool_alloc(owner, size);
+
+	test_check(res, "Chunked pools refuse to adopt",
+		   pool_adopt(chunked, owner, size) < 0
+		   && pool_adopt(heir, chunked, 0) < 0);
+	test_check(res, "Only bytes in use can be adopted",
+		   pool_adopt(heir, owner, size + 1) < 0);
+	test_check(res, "Adopted bytes change hands",
+		   pool_adopt(heir, owner, size) == 0
+		   && pool_in_use(owner) == 0 && pool_in_use(heir) == size);
+
+	pool_free(heir, block, size);
+	test_check(res, "Adopted blocks are freed by their new pool",
+		   pool_in_use(heir) == 0);
+
+	pool_destroy(owner);
+	pool_destroy(heir);
+	pool_destroy(chunked);
+}
+
+
+TEST_DEFINE(asan_test_pool_destroy, res)
+{
+	TEST_AUTONAME(res);
+
+	Pool* p = pool_create(0);
+
+	size_t n_alloc = (rand() % 1000) + 1000;
+	while (n_alloc --> 0)
+		pool_alloc(p, (size_t)(rand() % 5000));
+
+	pool_destroy(p);
+}
+
+
+TEST_START
+(
+	test_pool_alloc,
+	test_pool_reuse,
+	test_pool_null,
+	test_pool_in_use,
+	test_pool_adopt,
+	asan_test_pool_destroy,
+)
@@ -1,6 +1,6 @@
 #include "trie.h"
 #include "trie.c"
-#include "stack.c"
+#include "pool.c"
 
 #include "ctest.h"
 
@@ -19,7 +19,7 @@ TEST_DEFINE(test_instantiation, res)
 	}
 
 	TrieNode* root = trie->root;
-	bool root_proper = root && root->segment && root->segment[0] == '\0'
+	bool root_proper = root && node_seg(root)[0] == '\0'
 			   && root->n_children == 0 && !root->value;
 	test_check(res, "Proper tree structure", root_proper);
 
@@ -53,6 +53,16 @@ static char* gen_rand_str(size_t len)
 	return arr;
 }
 
+static char* str_copy(const char* str)
+{
+	return add_strs(NULL, str, strlen(str), "", 0);
+}
+
+static char* str_add(const char* str1, const char* str2)
+{
+	return add_strs(NULL, str1, strlen(str1), str2, strlen(str2));
+}
+
 #if 0
 size_t n_freed;
 
@@ -143,7 +153,7 @@ static __attribute_used__ TrieNode* gen_singleton_wlen(TestResult* res, size_t k
 {
 	char* seg = gen_rand_str(keylen);
 	void* value = malloc(100);
-	TrieNode* node = node_create(seg, value);
+	TrieNode* node = node_create(NULL, seg, keylen, value);
 	if (!node)
 		test_check(res, "Node allocation failed", false);
 	free(seg);
@@ -153,13 +163,7 @@ static __attribute_used__ TrieNode* gen_singleton_wlen(TestResult* res, size_t k
 
 static __attribute_used__ TrieNode* gen_singleton(TestResult* res)
 {
-	char* seg = gen_rand_str(gen_len_bw(1, 10));
-	void* value = malloc(100);
-	TrieNode* node = node_create(seg, value);
-	if (!node)
-		test_check(res, "Node allocation failed", false);
-	free(seg);
-	return node;
+	return gen_singleton_wlen(res, gen_len_bw(1, 2 * SEG_LOCAL_SIZE));
 }
 
 
@@ -167,7 +171,7 @@ static __attribute_used__ void singleton_free(TrieNode* node)
 {
 	if (!node)
 		return;
-	free(node->segment);
+	seg_free(NULL, node);
 	free(node->value);
 	free(node->children);
 	free(node);
@@ -183,10 +187,11 @@ TEST_DEFINE(test_node_create, res)
 		test_check(res, "Node is NULL on failure", true);
 		return;
 	}
-	char* seg = str_dup(node->segment);
+	char* seg = str_copy(node_seg(node));
 	void* value = node->value;
 	test_check(res, "No initial children", node->n_children == 0);
-	bool seg_match = node->segment && strcmp(node->segment, seg) == 0;
+	bool seg_match = strcmp(node_seg(node), seg) == 0
+			 && node->seglen == strlen(seg);
 	bool val_match = node->value && memcmp(node->value, value, 100) == 0;
 	test_check(res, "Segment and value match", seg_match && val_match);
 
@@ -195,6 +200,37 @@ TEST_DEFINE(test_node_create, res)
 }
 
 
+TEST_DEFINE(test_segment_layout, res)
+{
+	TEST_AUTONAME(res);
+
+	size_t len = gen_len_bw(1, 3 * SEG_LOCAL_SIZE);
+	size_t at = gen_len_bw(0, len - 1);
+	TrieNode* node = gen_singleton_wlen(res, len);
+	if (!node)
+		return;
+	char* seg = str_copy(node_seg(node));
+
+	bool local = node_seg(node) == node->seg.local;
+	test_check(res, "Short segments are stored inside the node",
+		   local == (len < SEG_LOCAL_SIZE));
+
+	bool split = node_split(NULL, node, at) == 0;
+	split = split && node->seglen == at
+		&& strncmp(node_seg(node), seg, at) == 0
+		&& node_seg(node)[at] == '\0'
+		&& (at == 0 || strcmp(node_seg(node->children), seg + at) == 0);
+	test_check(res, "Split segments are partitioned", split);
+
+	bool merged = node_merge(NULL, node, free) == 0
+		      && node->seglen == len && strcmp(node_seg(node), seg) == 0;
+	test_check(res, "Merged segments are concatenated", merged);
+
+	singleton_free(node);
+	free(seg);
+}
+
+
 static __attribute_used__ bool test_add(char* str1, char* str2, char* strsum)
 {
 	while (*str1 && *strsum)
@@ -210,7 +246,8 @@ static __attribute_used__ bool test_add(char* str1, char* str2, char* strsum)
 TEST_DEFINE(test_insert, res)
 {
 #define KEY_INSERT(str1, str2) \
-	(trie_insert(trie,_seg=add_strs((str1),(str2)),malloc(10)),free(_seg))
+	(trie_insert(trie, _seg = str_add((str1), (str2)), malloc(10)), \
+	 free(_seg))
 
 	TEST_AUTONAME(res);
 
@@ -232,7 +269,7 @@ TEST_DEFINE(test_insert, res)
 	char* seg2_1 = gen_rand_str(gen_len_bw(1, 10));
 	seg2_1[0] = 'a';
 	char* seg2_2 = gen_rand_str(gen_len_bw(1, 10));
-	char* seg2 = add_strs(seg2_1, seg2_2);
+	char* seg2 = str_add(seg2_1, seg2_2);
 	char* seg3 = gen_rand_str(gen_len_bw(1, 10));
 	seg3[0] = 'z';
 	char* seg4 = gen_rand_str(gen_len_bw(1, 10));
@@ -261,12 +298,12 @@ TEST_DEFINE(test_insert, res)
 	test_check(res, "Trie structure complete",
 		   node1 && node2 && node3 && node4 && node5 && node6);
 	test_check(res, "Trie segments formed as expected",
-		   node1 && strcmp(node1->segment, seg1) == 0
-		   && node2 && strcmp(node2->segment, seg2) == 0
-		   && node3 && strcmp(node3->segment, seg3) == 0
-		   && node4 && strcmp(node4->segment, seg4) == 0
-		   && node5 && strcmp(node5->segment, seg5) == 0
-		   && node6 && strcmp(node6->segment, seg6) == 0);
+		   node1 && strcmp(node_seg(node1), seg1) == 0
+		   && node2 && strcmp(node_seg(node2), seg2) == 0
+		   && node3 && strcmp(node_seg(node3), seg3) == 0
+		   && node4 && strcmp(node_seg(node4), seg4) == 0
+		   && node5 && strcmp(node_seg(node5), seg5) == 0
+		   && node6 && strcmp(node_seg(node6), seg6) == 0);
 
 	free(seg1);
 	free(seg2_1);
@@ -285,7 +322,8 @@ static __attribute_used__ bool tries_equal(TrieNode* node1, TrieNode* node2)
 {
 	if (!node1 || !node2)
 		return !node1 && !node2;
-	if (strcmp(node1->segment, node2->segment) != 0)
+	if (node1->seglen != node2->seglen
+	    || memcmp(node_seg(node1), node_seg(node2), node1->seglen) != 0)
 		return false;
 	if (node1->n_children != node2->n_children)
 		return false;
@@ -385,8 +423,8 @@ TEST_DEFINE(test_delete, res)
 		trie_delete(trie_b, "");
 		compact = compact && test_compact(trie_b);
 		empty_noaffect = empty_noaffect
-			&& trie_a->root && trie_a->root->segment[0] == '\0'
-			&& trie_b->root && trie_b->root->segment[0] == '\0';
+			&& trie_a->root && node_seg(trie_a->root)[0] == '\0'
+			&& trie_b->root && node_seg(trie_b->root)[0] == '\0';
 
 		add_delete = add_delete
 			&& tries_equal(trie_a->root, trie_b->root);
@@ -406,6 +444,321 @@ TEST_DEFINE(test_delete, res)
 }
 
 
+TEST_DEFINE(test_arena, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* heap = trie_create(TRIE_OPS_FREE);
+	Trie* arena = trie_create_flags(TRIE_OPS_FREE, TRIE_ARENA);
+
+	size_t n_keys = gen_len_bw(10, 100);
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	for (size_t i=0; i<n_keys; ++i) {
+		keys[i] = gen_rand_str(gen_len_bw(0, 20));
+		if (i > 0 && keys[i][0] && rand() % 3 == 0)
+			keys[i][0] = keys[i-1][0];
+		trie_insert(heap, keys[i], malloc(10));
+		trie_insert(arena, keys[i], malloc(10));
+	}
+	for (size_t i=0; i<n_keys; ++i) {
+		if (rand() & 1)
+			continue;
+		trie_delete(heap, keys[i]);
+		trie_delete(arena, keys[i]);
+	}
+
+	bool found_same = true;
+	for (size_t i=0; i<n_keys; ++i)
+		found_same = found_same && !trie_find(heap, keys[i])
+					   == !trie_find(arena, keys[i]);
+	test_check(res, "Arena trie has the same structure",
+		   tries_equal(heap->root, arena->root));
+	test_check(res, "Arena trie finds the same keys", found_same);
+	test_check(res, "Arena trie stays compact", test_compact(arena));
+
+	for (size_t i=0; i<n_keys; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(heap);
+	trie_destroy(arena);
+}
+
+
+static size_t usage_recursive(TrieNode* node)
+{
+	size_t result = sizeof *node + children_size(node->capacity)
+			- node->n_children * sizeof *node;
+	if (node->seglen >= SEG_LOCAL_SIZE)
+		result += node->seglen + 1;
+	for (size_t i = 0; i < node->n_children; ++i)
+		result += usage_recursive(&node->children[i]);
+	return result;
+}
+
+
+TEST_DEFINE(test_deep_walk, res)
+{
+	TEST_AUTONAME(res);
+
+	/* Every level has a later sibling, so walks keep a frame per level */
+	size_t depth = gen_len_bw(40, 120);
+	char* key = gen_rand_str(depth);
+	unsigned flags = rand() & 1 ? TRIE_ARENA : 0;
+	Trie* trie = trie_create_flags(TRIE_OPS_FREE, flags);
+	for (size_t len = 0; len < depth; ++len) {
+		key[len] = (char)('a' + rand() % 25);
+		char last = key[len + 1];
+		key[len + 1] = 'z';
+		trie_insert_n(trie, key, len + 2, malloc(1));
+		key[len + 1] = last;
+		trie_insert_n(trie, key, len + 1, malloc(1));
+	}
+
+	test_check(res, "Memory usage matches a recursive walk",
+		   trie_memory_usage(trie) == usage_recursive(trie->root));
+
+	size_t n_found = 0;
+	TrieIterator* iter = trie_findall(trie, "", depth + 1);
+	for (; iter; trie_iter_next(&iter))
+		++n_found;
+	test_check(res, "Iterators walk every level",
+		   n_found == trie_stats(trie).n_keys);
+
+	free(key);
+	trie_destroy(trie);
+}
+
+
+static size_t value_size(void* val)
+{
+	return *(size_t*)val;
+}
+
+
+static void count_nodes(TrieNode* node, size_t* n_nodes, size_t* n_keys,
+			size_t* value_bytes)
+{
+	++*n_nodes;
+	if (node->value) {
+		++*n_keys;
+		*value_bytes += value_size(node->value);
+	}
+	for (size_t i = 0; i < node->n_children; ++i)
+		count_nodes(&node->children[i], n_nodes, n_keys, value_bytes);
+}
+
+
+TEST_DEFINE(test_stats, res)
+{
+	TEST_AUTONAME(res);
+
+	unsigned flags = rand() & 1 ? TRIE_ARENA : 0;
+	Trie* trie = trie_create_flags(trie_makeops(free, value_size), flags);
+	size_t n_keys = gen_len_bw(10, 200);
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	for (size_t i=0; i<n_keys; ++i) {
+		keys[i] = gen_rand_str(gen_len_bw(0, 40));
+		if (i > 0 && keys[i][0] && rand() % 3 == 0)
+			keys[i][0] = keys[i-1][0];
+	}
+
+	bool consistent = true;
+	for (size_t i=0; i<2*n_keys; ++i) {
+		char* key = keys[(size_t)rand() % n_keys];
+		if (rand() % 3 == 0) {
+			trie_delete(trie, key);
+		} else {
+			size_t* val = malloc(sizeof *val);
+			*val = (size_t)(rand() % 1000);
+			if (trie_insert(trie, key, val) < 0)
+				free(val);
+		}
+
+		size_t n_nodes = 0, n_found = 0, value_bytes = 0;
+		count_nodes(trie->root, &n_nodes, &n_found, &value_bytes);
+		struct TrieStats stats = trie_stats(trie);
+		consistent = consistent && stats.n_nodes == n_nodes
+			     && stats.n_keys == n_found
+			     && stats.value_bytes == value_bytes
+			     && stats.node_bytes == usage_recursive(trie->root)
+			     && trie_memory_usage(trie)
+				== stats.node_bytes + stats.value_bytes;
+	}
+	test_check(res, "Counters match a walk of the trie", consistent);
+
+	for (size_t i=0; i<n_keys; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(trie);
+}
+
+
+static bool root_table_consistent(Trie* trie)
+{
+	RootTable* table = trie->root_table;
+	RootTable* fresh = malloc(sizeof *fresh);
+	for (size_t i = 0; i < 256; ++i)
+		root_row_build(fresh, trie->root, (unsigned char)i);
+	bool same = memcmp(table, fresh, sizeof *fresh) == 0;
+	free(fresh);
+	return same;
+}
+
+
+TEST_DEFINE(test_root_table, res)
+{
+	TEST_AUTONAME(res);
+
+	static const char alphabet[] = {0, 1, 2, 'a'};
+	unsigned flags = TRIE_ROOT_TABLE | (rand() & 1 ? TRIE_ARENA : 0);
+	Trie* plain = trie_create(TRIE_OPS_NONE);
+	Trie* table = trie_create_flags(TRIE_OPS_NONE, flags);
+
+	size_t n_keys = gen_len_bw(10, 60);
+	char (*keys)[4] = malloc(n_keys * sizeof keys[0]);
+	size_t* lens = malloc(n_keys * sizeof lens[0]);
+	for (size_t i=0; i<n_keys; ++i) {
+		lens[i] = gen_len_bw(0, 4);
+		for (size_t j=0; j<lens[i]; ++j)
+			keys[i][j] = alphabet[rand() % 4];
+	}
+
+	bool same = true;
+	for (size_t op=0; op<3*n_keys; ++op) {
+		size_t k = (size_t)rand() % n_keys;
+		if (rand() % 3 == 0) {
+			trie_delete_n(plain, keys[k], lens[k]);
+			trie_delete_n(table, keys[k], lens[k]);
+		} else {
+			trie_insert_n(plain, keys[k], lens[k], &keys[k]);
+			trie_insert_n(table, keys[k], lens[k], &keys[k]);
+		}
+		for (size_t i=0; i<n_keys; ++i)
+			same = same && trie_find_n(plain, keys[i], lens[i])
+				       == trie_find_n(table, keys[i], lens[i]);
+	}
+	test_check(res, "Lookups through the root table match", same);
+	test_check(res, "Root table matches the trie",
+		   root_table_consistent(table));
+	test_check(res, "Root table leaves the trie unchanged",
+		   tries_equal(plain->root, table->root));
+
+	free(keys);
+	free(lens);
+	trie_destroy(plain);
+	trie_destroy(table);
+}
+
+
+static bool node_kind_consistent(TrieNode* node)
+{
+	unsigned char* keys = node_keys(node);
+	for (size_t i = 0; i < node->n_children; ++i) {
+		TrieNode* child = &node->children[i];
+		if (keys[i] != node_byte(child)
+		    || (i > 0 && keys[i - 1] >= keys[i])
+		    || find_child(node, keys[i]) != child
+		    || !node_kind_consistent(child))
+			return false;
+	}
+	return true;
+}
+
+TEST_DEFINE(test_node_kinds, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	/* Room for a whole vector load, which the compiler cannot rule out */
+	char key[16] = {0};
+	bool in_trie[256] = {false};
+	bool consistent = true, found = true;
+
+	size_t n_ops = gen_len_bw(100, 600);
+	for (size_t i = 0; i < n_ops; ++i) {
+		unsigned char c = (unsigned char)gen_len_bw(1, 255);
+		key[0] = (char)c;
+		key[1] = rand() & 1 ? 'x' : '\0';
+		if (rand() % 3) {
+			trie_insert(trie, key, trie);
+			in_trie[c] = in_trie[c] || !key[1];
+		} else {
+			trie_delete(trie, key);
+			in_trie[c] = in_trie[c] && key[1];
+		}
+		consistent = consistent && node_kind_consistent(trie->root);
+	}
+	key[1] = '\0';
+	for (int c = 1; c < 256; ++c) {
+		key[0] = (char)c;
+		found = found && !trie_find(trie, key) == !in_trie[c];
+	}
+
+	test_check(res, "Child vectors stay sorted and indexed",
+		   consistent);
+	test_check(res, "Keys are found at every fanout", found);
+
+	trie_destroy(trie);
+}
+
+
+TEST_DEFINE(test_child_capacity, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	char key[2] = {0};
+	size_t n_keys = gen_len_bw(2, 255);
+	for (size_t c = 1; c <= n_keys; ++c) {
+		key[0] = (char)c;
+		trie_insert(trie, key, trie);
+	}
+	TrieNode* root = trie->root;
+	size_t capacity = root->capacity;
+	test_check(res, "Capacity grows geometrically",
+		   capacity >= n_keys && capacity < 2 * n_keys
+		   && (capacity & (capacity - 1)) == 0);
+
+	bool deleted = true;
+	size_t n_left = gen_len_bw(1, n_keys);
+	for (size_t c = n_left + 1; c <= n_keys; ++c) {
+		key[0] = (char)c;
+		deleted = deleted && trie_delete(trie, key) == 0
+			  && !trie_find(trie, key);
+	}
+	test_check(res, "Deletions succeed", deleted);
+	test_check(res, "Capacity shrinks lazily",
+		   root->n_children == n_left && root->capacity >= n_left
+		   && root->capacity <= 4 * n_left
+		   && root->capacity <= capacity);
+	test_check(res, "Child vectors stay sorted and indexed",
+		   node_kind_consistent(root));
+	trie_destroy(trie);
+
+	/* Bulk loads size vectors exactly, so growth starts off a power of 2 */
+	char bytes[NODE_MAX_CAPACITY];
+	const char* keys[NODE_MAX_CAPACITY];
+	size_t lens[NODE_MAX_CAPACITY];
+	void* values[NODE_MAX_CAPACITY];
+	n_keys = gen_len_bw(129, 255);
+	for (size_t i=0; i<n_keys; ++i) {
+		bytes[i] = (char)i;
+		keys[i] = &bytes[i];
+		lens[i] = 1;
+		values[i] = bytes;
+	}
+	trie = trie_build_sorted(TRIE_OPS_NONE, 0, keys, lens, values, n_keys);
+	key[0] = (char)n_keys;
+	trie_insert_n(trie, key, 1, bytes);
+	test_check(res, "Capacity stops at the number of bytes",
+		   trie->root->n_children == n_keys + 1
+		   && trie->root->capacity <= NODE_MAX_CAPACITY
+		   && node_kind_consistent(trie->root));
+
+	trie_destroy(trie);
+}
+
+
 TEST_DEFINE(test_find, res)
 {
 	TEST_AUTONAME(res);
@@ -462,6 +815,110 @@ TEST_DEFINE(test_find, res)
 }
 
 
+static bool bytes_lt(const char* key1, size_t len1, const char* key2,
+		     size_t len2)
+{
+	int cmp = memcmp(key1, key2, len1 < len2 ? len1 : len2);
+	return cmp < 0 || (cmp == 0 && len1 < len2);
+}
+
+
+TEST_DEFINE(test_binary_keys, res)
+{
+	TEST_AUTONAME(res);
+
+	typedef struct key_val {
+		char key[8];
+		size_t len;
+		void* val;
+		bool ins;
+	} key_val_t;
+
+	Trie* trie = trie_create(TRIE_OPS_NONE);
+	size_t n_kv = gen_len_bw(100, 300), n_ins = 0;
+	key_val_t* kv = malloc(n_kv * sizeof kv[0]);
+	for (size_t i=0; i<n_kv; ++i) {
+		kv[i].len = gen_len_bw(0, sizeof kv[i].key);
+		for (size_t j=0; j<kv[i].len; ++j)
+			kv[i].key[j] = (char)(rand() & 1 ? 0 : rand());
+		kv[i].val = &kv[i];
+		kv[i].ins = false;
+	}
+	for (size_t i=0; i<n_kv; ++i) {
+		if (rand() & 1)
+			continue;
+		for (size_t j=0; j<n_kv; ++j)
+			if (kv[j].len == kv[i].len
+			    && memcmp(kv[j].key, kv[i].key, kv[i].len) == 0)
+				kv[j].ins = false;
+		kv[i].ins = trie_insert_n(trie, kv[i].key, kv[i].len,
+					  kv[i].val) == 0;
+	}
+
+	bool found = true;
+	for (size_t i=0; i<n_kv; ++i) {
+		void* val = trie_find_n(trie, kv[i].key, kv[i].len);
+		if (kv[i].ins && val != kv[i].val)
+			found = false;
+		n_ins += kv[i].ins;
+	}
+	test_check(res, "Keys with zero bytes are found", found);
+	test_check(res, "Child vectors stay consistent",
+		   node_kind_consistent(trie->root) && test_compact(trie));
+
+	bool sorted = true, lengths = true;
+	size_t n_seen = 0, len_prev = 0;
+	char key_prev[8];
+	TrieIterator* iter = trie_findall_n(trie, "", 0, 8);
+	while (iter) {
+		const char* key = trie_iter_getkey(iter);
+		size_t len = trie_iter_getkeylen(iter);
+		key_val_t* it = (key_val_t*)trie_iter_getval(iter);
+		lengths = lengths && len == it->len
+			  && memcmp(key, it->key, len) == 0 && key[len] == 0;
+		sorted = sorted && (n_seen == 0
+				    || bytes_lt(key_prev, len_prev, key, len));
+		memcpy(key_prev, key, len_prev = len);
+		++n_seen;
+		trie_iter_next(&iter);
+	}
+	test_check(res, "Iterated keys report their lengths", lengths);
+	test_check(res, "Keys with zero bytes are enumerated in order", sorted);
+	test_check(res, "All keys with zero bytes are enumerated",
+		   n_seen == n_ins);
+
+	for (size_t i=0; i<n_kv; ++i)
+		trie_delete_n(trie, kv[i].key, kv[i].len);
+	bool deleted = trie->root->n_children == 0 && !trie->root->value;
+	test_check(res, "Keys with zero bytes are deleted", deleted);
+
+	trie_destroy(trie);
+	free(kv);
+}
+
+
+TEST_DEFINE(test_pflen, res)
+{
+	TEST_AUTONAME(res);
+
+	size_t len = gen_len_bw(0, 100), n = gen_len_bw(0, len);
+	char* of = gen_rand_str(len);
+	char* with = str_copy(of);
+	size_t at = gen_len_bw(0, len);
+	if (at < len)
+		with[at] = (char)(with[at] ^ (1 << (rand() % 8)));
+
+	size_t expected = 0;
+	while (expected < n && of[expected] == with[expected])
+		++expected;
+	test_check(res, "Common prefix length matches a byte-wise scan",
+		   pflen(of, with, n) == expected);
+
+	free(of);
+	free(with);
+}
+
+
 TEST_DEFINE(test_segncpy, res)
 {
 	TEST_AUTONAME(res);
@@ -469,9 +926,9 @@ TEST_DEFINE(test_segncpy, res)
 	char *buf = key_buffer_create(15), *oldbuf = buf;
 
 	bool concat = true;
-	buf = segncpy(buf, "Hello ", 100);
+	buf = segncpy(buf, "Hello ", 6);
 	concat = concat && strcmp(oldbuf, "Hello ") == 0;
-	buf = segncpy(buf, "world!", 100);
+	buf = segncpy(buf, "world!", 6);
 	concat = concat && strcmp(oldbuf, "Hello world!") == 0;
 	oldbuf[15] = '\0';
 	buf = segncpy(buf, "Additional text", 3);
@@ -484,28 +941,51 @@ TEST_DEFINE(test_segncpy, res)
 }
 
 
-TEST_DEFINE(test_key_add_segment, res)
+TEST_DEFINE(test_unbounded_iter, res)
 {
 	TEST_AUTONAME(res);
 
-	char *buf = key_buffer_create(15), *oldbuf = buf;
-
-	bool concat = true;
-	buf = key_add_segment(buf, "Hello ", oldbuf, 15);
-	concat = concat && strcmp(oldbuf, "Hello ") == 0;
-	buf = key_add_segment(buf, "world!", oldbuf, 15);
-	concat = concat && strcmp(oldbuf, "Hello world!") == 0;
-	char* invalid_buf = key_add_segment(buf, "Additional", oldbuf, 15);
-	char* valid_buf = key_add_segment(buf, "Add", oldbuf, 15);
-	bool oob_concat = !invalid_buf;
-	bool last_concat = strcmp(oldbuf, "Hello world!Add") == 0 && valid_buf
-			     && oldbuf[15] == '\0' && valid_buf == &oldbuf[15];
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = gen_len_bw(20, 100), max_keylen = gen_len_bw(1, 30);
+	size_t n_bounded = 0, longest = 0;
+	for (size_t i=0; i<n_keys; ++i) {
+		size_t len = gen_len_bw(1, rand() % 10 ? 40 : 3000);
+		char* key = gen_rand_str(len);
+		if (trie_find(trie, key)) {
+			free(key);
+			continue;
+		}
+		trie_insert(trie, key, malloc(1));
+		n_bounded += len <= max_keylen;
+		longest = len > longest ? len : longest;
+		free(key);
+	}
+	size_t n_any = trie_stats(trie).n_keys;
 
-	test_check(res, "Middle concat correct", concat);
-	test_check(res, "NULL returned on out-of-bounds concat", oob_concat);
-	test_check(res, "Last concat correct", last_concat);
+	size_t n_found = 0, keycap = 0;
+	TrieIterator* iter = trie_findall(trie, "", TRIE_KEYLEN_ANY);
+	for (; iter; trie_iter_next(&iter)) {
+		keycap = iter->keycap > keycap ? iter->keycap : keycap;
+		++n_found;
+	}
+	test_check(res, "Unbounded iteration finds every key",
+		   n_found == n_any);
+	test_check(res, "Key buffer grows to the longest key",
+		   keycap >= longest && keycap < 2 * longest + 64);
+
+	bool capped = true;
+	n_found = 0;
+	iter = trie_findall(trie, "", max_keylen);
+	for (; iter; trie_iter_next(&iter)) {
+		capped = capped && iter->keycap <= max_keylen
+			 && iter->keylen <= max_keylen;
+		++n_found;
+	}
+	test_check(res, "Bounded iteration finds keys within the bound",
+		   n_found == n_bounded);
+	test_check(res, "Key buffer stays within the bound", capped);
 
-	free(oldbuf);
+	trie_destroy(trie);
 }
 
 
@@ -567,7 +1047,7 @@ TEST_DEFINE(test_iterator, res)
 		kv[i].key = gen_rand_str(gen_len_bw(10, N));
 		kv[i].val = malloc(1);
 		if (!prf) {
-			prf = str_dup(kv[i].key), prf[pf_len] = 0;
+			prf = str_copy(kv[i].key), prf[pf_len] = 0;
 			continue;
 		}
 		for (size_t j=0; j<i; ++j) {
@@ -591,9 +1071,8 @@ TEST_DEFINE(test_iterator, res)
 	bool sorted = true, complete = true, sound = true, bounded = true,
 	     prefixed = true, val_correct = true;
 	TrieIterator* iter = trie_findall(trie, prf, max_keylen);
-	const char* key = NULL;
+	char* key_prev = NULL;
 	while (iter) {
-		char* key_prev = key ? str_dup(key) : NULL;
 		const char* key = trie_iter_getkey(iter);
 		void* val = trie_iter_getval(iter);
 		size_t i;
@@ -604,7 +1083,6 @@ TEST_DEFINE(test_iterator, res)
 		if (i == n_kv) {
 			sound = false;
 			trie_iter_next(&iter);
-			free(key_prev);
 			continue;
 		}
 		n_found += is_prefix(prf, key) && strlen(key) <= max_keylen;
@@ -613,9 +1091,11 @@ TEST_DEFINE(test_iterator, res)
 		prefixed = prefixed && is_prefix(prf, key);
 		val_correct = val_correct && val == kv[i].val;
 
-		trie_iter_next(&iter);
 		free(key_prev);
+		key_prev = str_copy(key);
+		trie_iter_next(&iter);
 	}
+	free(key_prev);
 	complete = n_findable == n_found;
 	sound = sound && bounded && prefixed;
 
@@ -635,17 +1115,1002 @@ TEST_DEFINE(test_iterator, res)
 }
 
 
+TEST_DEFINE(test_reverse_iter, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = gen_len_bw(50, 150), max_keylen = gen_len_bw(3, 20);
+	const char* prf = rand()&1 ? "" : "a";
+	for (size_t i=0; i<n_keys; ++i) {
+		char* suffix = gen_rand_str(gen_len_bw(1, 20));
+		char* key = str_add(prf, suffix);
+		if (!trie_find(trie, key))
+			trie_insert(trie, key, malloc(1));
+		free(suffix);
+		free(key);
+	}
+
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	size_t n_fwd = 0;
+	TrieIterator* iter = trie_findall(trie, prf, max_keylen);
+	for (; iter; trie_iter_next(&iter))
+		keys[n_fwd++] = str_copy(trie_iter_getkey(iter));
+
+	bool reversed = true;
+	size_t n_back = 0;
+	iter = trie_findlast(trie, prf, max_keylen);
+	for (; iter; trie_iter_prev(&iter), ++n_back)
+		reversed = reversed && n_back < n_fwd
+			   && strcmp(keys[n_fwd - n_back - 1],
+				     trie_iter_getkey(iter)) == 0;
+	test_check(res, "Reverse iteration mirrors forward iteration",
+		   reversed && n_back == n_fwd);
+
+	bool round_trip = true;
+	size_t pos = 0;
+	iter = trie_findall(trie, prf, max_keylen);
+	for (size_t i=0; iter && i<n_fwd; ++i) {
+		if (rand()&1 || pos == 0) {
+			trie_iter_next(&iter);
+			++pos;
+		} else {
+			trie_iter_prev(&iter);
+			--pos;
+		}
+		if (iter)
+			round_trip = round_trip && pos < n_fwd
+				     && strcmp(keys[pos],
+					       trie_iter_getkey(iter)) == 0;
+		else
+			round_trip = round_trip && pos == n_fwd;
+	}
+	test_check(res, "Next and prev can be interleaved", round_trip);
+	trie_iter_destroy(iter);
+
+	iter = trie_findlast(trie, prf, max_keylen);
+	trie_iter_next(&iter);
+	test_check(res, "Advancing past the last key ends iteration", !iter);
+
+	for (size_t i=0; i<n_fwd; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(trie);
+}
+
+
+TEST_DEFINE(test_seek, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = gen_len_bw(50, 150);
+	for (size_t i=0; i<n_keys; ++i) {
+		char* key = gen_rand_str(gen_len_bw(0, 12));
+		if (!trie_find(trie, key))
+			trie_insert(trie, key, malloc(1));
+		free(key);
+	}
+
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	size_t n_sorted = 0;
+	TrieIterator* iter = trie_findall(trie, "", TRIE_KEYLEN_ANY);
+	for (; iter; trie_iter_next(&iter))
+		keys[n_sorted++] = str_copy(trie_iter_getkey(iter));
+
+	bool lower = true, upper = true;
+	for (size_t i=0; i<200; ++i) {
+		char* probe = rand()&1 ? gen_rand_str(gen_len_bw(0, 12))
+				       : str_copy(keys[rand() % n_sorted]);
+		if (rand()&1)
+			probe[strlen(probe) / 2] = '\0';
+
+		size_t lb = 0, ub;
+		while (lb < n_sorted && strcmp(keys[lb], probe) < 0)
+			++lb;
+		ub = lb < n_sorted && strcmp(keys[lb], probe) == 0 ? lb + 1
+								  : lb;
+
+		iter = trie_seek(trie, probe);
+		lower = lower && (iter ? lb < n_sorted
+					 && strcmp(trie_iter_getkey(iter),
+						   keys[lb]) == 0
+				       : lb == n_sorted);
+		trie_iter_destroy(iter);
+		iter = trie_upper_bound(trie, probe);
+		upper = upper && (iter ? ub < n_sorted
+					 && strcmp(trie_iter_getkey(iter),
+						   keys[ub]) == 0
+				       : ub == n_sorted);
+		trie_iter_destroy(iter);
+		free(probe);
+	}
+	test_check(res, "Seek finds the first key not less", lower);
+	test_check(res, "Upper bound finds the first key greater", upper);
+
+	size_t page = gen_len_bw(1, 10), n_paged = 0;
+	char* last = NULL;
+	bool in_order = true;
+	do {
+		iter = last ? trie_upper_bound(trie, last)
+			    : trie_seek(trie, "");
+		free(last);
+		last = NULL;
+		for (size_t i=0; iter && i<page; ++i, trie_iter_next(&iter)) {
+			in_order = in_order && n_paged < n_sorted
+				   && strcmp(keys[n_paged],
+					     trie_iter_getkey(iter)) == 0;
+			free(last);
+			last = str_copy(trie_iter_getkey(iter));
+			++n_paged;
+		}
+		trie_iter_destroy(iter);
+	} while (last);
+	test_check(res, "Paginated scan resumes after the last key",
+		   in_order && n_paged == n_sorted);
+
+	for (size_t i=0; i<n_sorted; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(trie);
+}
+
+
+TEST_DEFINE(test_range, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = gen_len_bw(50, 150);
+	for (size_t i=0; i<n_keys; ++i) {
+		char* key = gen_rand_str(gen_len_bw(0, 12));
+		if (!trie_find(trie, key))
+			trie_insert(trie, key, malloc(1));
+		free(key);
+	}
+
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	size_t n_sorted = 0;
+	TrieIterator* iter = trie_findall(trie, "", TRIE_KEYLEN_ANY);
+	for (; iter; trie_iter_next(&iter))
+		keys[n_sorted++] = str_copy(trie_iter_getkey(iter));
+
+	bool exact = true, bounded_back = true;
+	for (size_t i=0; i<100; ++i) {
+		char *lo = rand()&1 ? gen_rand_str(gen_len_bw(0, 6))
+				    : str_copy(keys[rand() % n_sorted]),
+		     *hi = rand()&1 ? gen_rand_str(gen_len_bw(0, 6))
+				    : str_copy(keys[rand() % n_sorted]);
+
+		size_t first = 0, last;
+		while (first < n_sorted && strcmp(keys[first], lo) < 0)
+			++first;
+		for (last = first; last < n_sorted
+				   && strcmp(keys[last], hi) < 0; ++last);
+
+		size_t pos = first;
+		iter = trie_range(trie, lo, hi);
+		for (; iter; trie_iter_next(&iter), ++pos)
+			exact = exact && pos < last
+				&& strcmp(keys[pos],
+					  trie_iter_getkey(iter)) == 0;
+		exact = exact && pos == (first < last ? last : first);
+
+		size_t n_back = 0;
+		iter = trie_range(trie, lo, hi);
+		if (iter) {
+			trie_iter_next(&iter);
+			for (; iter; trie_iter_prev(&iter))
+				++n_back;
+		}
+		bounded_back = bounded_back
+			       && n_back == (last - first > 1 ? 2 : 0);
+
+		free(lo);
+		free(hi);
+	}
+	test_check(res, "Range covers exactly the keys in [lo, hi)", exact);
+	test_check(res, "Moving back stops at the lower bound", bounded_back);
+
+	for (size_t i=0; i<n_sorted; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(trie);
+}
+
+
+typedef struct VisitLog {
+	char** keys;
+	size_t n_seen, n_stop;
+	bool matched;
+} VisitLog;
+
+static int visit_check(const char* key, size_t keylen, void* value,
+		       void* ctx)
+{
+	VisitLog* log = ctx;
+	const char* expected = log->keys[log->n_seen++];
+	log->matched = log->matched && value
+		       && (key ? strcmp(key, expected) == 0
+				 && strlen(key) == keylen
+			       : strlen(expected) == keylen);
+	return log->n_seen == log->n_stop;
+}
+
+TEST_DEFINE(test_foreach, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = gen_len_bw(50, 150);
+	const char* prf = rand()&1 ? "" : "a";
+	for (size_t i=0; i<n_keys; ++i) {
+		char* key = gen_rand_str(gen_len_bw(0, rand()&1 ? 12 : 200));
+		if (!trie_find(trie, key))
+			trie_insert(trie, key, malloc(1));
+		free(key);
+	}
+
+	VisitLog log;
+	log.keys = malloc(n_keys * sizeof log.keys[0]);
+	size_t n_found = 0;
+	TrieIterator* iter = trie_findall(trie, prf, TRIE_KEYLEN_ANY);
+	for (; iter; trie_iter_next(&iter))
+		log.keys[n_found++] = str_copy(trie_iter_getkey(iter));
+
+	log.n_seen = 0, log.n_stop = 0, log.matched = true;
+	int rc = trie_foreach(trie, prf, visit_check, &log);
+	test_check(res, "Visits every key in iterator order",
+		   rc == 0 && log.matched && log.n_seen == n_found);
+
+	log.n_seen = 0, log.n_stop = 0, log.matched = true;
+	rc = rand() & 1
+		? trie_foreach_value(trie, prf, visit_check, &log)
+		: trie_foreach_value_n(trie, prf, strlen(prf), visit_check,
+				       &log);
+	test_check(res, "Visits every value without keys",
+		   rc == 0 && log.matched && log.n_seen == n_found);
+
+	log.n_seen = 0, log.n_stop = n_found ? gen_len_bw(1, n_found) : 1;
+	log.matched = true;
+	rc = trie_foreach(trie, prf, visit_check, &log);
+	test_check(res, "Visitor stops the walk early",
+		   n_found ? rc == 1 && log.matched && log.n_seen == log.n_stop
+			   : rc == 0 && log.n_seen == 0);
+
+	for (size_t i=0; i<n_found; ++i)
+		free(log.keys[i]);
+	free(log.keys);
+	trie_destroy(trie);
+}
+
+
+TEST_DEFINE(test_split, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = rand()&1 ? gen_len_bw(0, 5) : gen_len_bw(50, 300);
+	/* Keys sharing a path prefix hang below a chain of single children */
+	const char* shared = rand()&1 ? "/data/v1/" : "";
+	const char* prf = rand()&1 ? "" : *shared ? "/data/" : "a";
+	for (size_t i=0; i<n_keys; ++i) {
+		char* suffix = gen_rand_str(gen_len_bw(0, 12));
+		char* key = add_strs(NULL, shared, strlen(shared), suffix,
+				     strlen(suffix));
+		if (!trie_find(trie, key))
+			trie_insert(trie, key, malloc(1));
+		free(suffix);
+		free(key);
+	}
+
+	char** keys = malloc((n_keys + 1) * sizeof keys[0]);
+	size_t n_found = 0;
+	TrieIterator* iter = trie_findall(trie, prf, TRIE_KEYLEN_ANY);
+	for (; iter; trie_iter_next(&iter))
+		keys[n_found++] = str_copy(trie_iter_getkey(iter));
+
+	size_t n = gen_len_bw(1, 16), pos = 0;
+	TrieIterator* iters[16];
+	size_t n_iters = trie_split(trie, prf, iters, n);
+	bool ordered = true, backed = true;
+	for (size_t i=0; i<n_iters; ++i) {
+		size_t piece_start = pos;
+		for (; iters[i]; trie_iter_next(&iters[i]), ++pos)
+			ordered = ordered && pos < n_found
+				  && strcmp(keys[pos],
+					    trie_iter_getkey(iters[i])) == 0;
+		backed = backed && pos > piece_start;
+	}
+	test_check(res, "Pieces cover every key in order",
+		   ordered && pos == n_found);
+	test_check(res, "Pieces are not empty", backed);
+	test_check(res, "Number of pieces is bounded",
+		   n_iters <= n && (n_iters > 0) == (n_found > 0));
+	test_check(res, "Large subtries are split",
+		   n == 1 || n_found < 8 * n || n_iters > 1);
+
+	for (size_t i=0; i<n_found; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(trie);
+}
+
+
+TEST_DEFINE(test_walker, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create(TRIE_OPS_FREE);
+	size_t n_keys = gen_len_bw(1, 60);
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	for (size_t i=0; i<n_keys; ++i) {
+		keys[i] = gen_rand_str(gen_len_bw(0, 8));
+		if (!trie_find(trie, keys[i]))
+			trie_insert(trie, keys[i], malloc(1));
+	}
+
+	bool stepped = true, fed = true;
+	for (size_t p=0; p<100; ++p) {
+		char* probe = rand()&1 ? gen_rand_str(gen_len_bw(0, 10))
+				       : str_copy(keys[rand() % n_keys]);
+		size_t len = strlen(probe);
+
+		struct TrieWalker byte_walker, chunk_walker;
+		unsigned state = trie_walker_init(&byte_walker, trie);
+		trie_walker_init(&chunk_walker, trie);
+		for (size_t i=0; i<=len; ++i) {
+			if (i)
+				state = trie_walker_step(&byte_walker,
+							 (unsigned char)
+							 probe[i - 1]);
+			bool is_key = false, more = false;
+			for (size_t k=0; k<n_keys; ++k) {
+				size_t klen = strlen(keys[k]);
+				if (klen < i || memcmp(keys[k], probe, i))
+					continue;
+				is_key = is_key || klen == i;
+				more = more || klen > i;
+			}
+			char save = probe[i];
+			probe[i] = '\0';
+			stepped = stepped
+				  && !(state & TRIE_WALK_VALUE) == !is_key
+				  && !(state & TRIE_WALK_MORE) == !more
+				  && trie_walker_value(&byte_walker)
+				     == trie_find(trie, probe);
+			probe[i] = save;
+		}
+
+		size_t cut = gen_len_bw(0, len);
+		trie_walker_feed(&chunk_walker, probe, cut);
+		fed = fed && trie_walker_feed(&chunk_walker, probe + cut,
+					      len - cut) == state
+		      && trie_walker_value(&chunk_walker)
+			 == trie_walker_value(&byte_walker);
+		free(probe);
+	}
+	test_check(res, "Stepping reports values and extensions", stepped);
+	test_check(res, "Feeding chunks matches stepping bytes", fed);
+
+	for (size_t i=0; i<n_keys; ++i)
+		free(keys[i]);
+	free(keys);
+	trie_destroy(trie);
+}
+
+
+static int cmp_keys(const void* key1, const void* key2)
+{
+	return strcmp(*(char* const*)key1, *(char* const*)key2);
+}
+
+TEST_DEFINE(test_build_sorted, res)
+{
+	TEST_AUTONAME(res);
+
+	size_t n_keys = rand()&1 ? gen_len_bw(0, 5) : gen_len_bw(50, 400);
+	char** keys = malloc((n_keys + 1) * sizeof keys[0]);
+	for (size_t i=0; i<n_keys; ++i)
+		keys[i] = gen_rand_str(gen_len_bw(0, rand()&1 ? 8 : 40));
+	qsort(keys, n_keys, sizeof keys[0], cmp_keys);
+	size_t n_unique = 0;
+	for (size_t i=0; i<n_keys; ++i) {
+		if (n_unique && strcmp(keys[n_unique - 1], keys[i]) == 0)
+			free(keys[i]);
+		else
+			keys[n_unique++] = keys[i];
+	}
+
+	/* Values are sizes for count_nodes */
+	size_t* sizes = calloc(n_unique + 1, sizeof sizes[0]);
+	void** vals = malloc((n_unique + 1) * sizeof vals[0]);
+	Trie* inserted = trie_create(TRIE_OPS_NONE);
+	for (size_t i=0; i<n_unique; ++i) {
+		vals[i] = &sizes[i];
+		trie_insert(inserted, keys[i], vals[i]);
+	}
+	unsigned flags = rand() & 3;
+	Trie* built = trie_build_sorted(TRIE_OPS_NONE, flags,
+					(const char* const*)keys, NULL, vals,
+					n_unique);
+
+	size_t n_nodes = 0, n_found = 0, value_bytes = 0;
+	count_nodes(built->root, &n_nodes, &n_found, &value_bytes);
+	bool found = true;
+	for (size_t i=0; i<n_unique; ++i)
+		found = found && trie_find(built, keys[i]) == vals[i];
+	test_check(res, "Built trie finds every key", found);
+	test_check(res, "Built trie matches an inserted one",
+		   tries_equal(built->root, inserted->root)
+		   && node_kind_consistent(built->root));
+	test_check(res, "Built trie keeps its counters",
+		   trie_stats(built).n_keys == n_unique && n_found == n_unique
+		   && trie_stats(built).n_nodes == n_nodes
+		   && trie_maxkeylen_added(built)
+		      == trie_maxkeylen_added(inserted));
+	test_check(res, "Built trie keeps its root table",
+		   !(flags & TRIE_ROOT_TABLE) || root_table_consistent(built));
+
+	bool rejected = true;
+	if (n_unique > 1) {
+		char* swap = keys[0];
+		keys[0] = keys[n_unique - 1];
+		keys[n_unique - 1] = swap;
+		rejected = !trie_build_sorted(TRIE_OPS_NONE, 0,
+					      (const char* const*)keys, NULL,
+					      vals, n_unique);
+	}
+	test_check(res, "Unsorted keys are rejected", rejected);
+
+	trie_destroy(built);
+	trie_destroy(inserted);
+	for (size_t i=0; i<n_unique; ++i)
+		free(keys[i]);
+	free(keys);
+	free(vals);
+	free(sizes);
+}
+
+
+TEST_DEFINE(test_apply_batch, res)
+{
+	TEST_AUTONAME(res);
+
+	unsigned flags = rand() & 3;
+	Trie* batched = trie_create_flags(TRIE_OPS_NONE, flags);
+	Trie* serial = trie_create_flags(TRIE_OPS_NONE, flags);
+	size_t n_pool = gen_len_bw(1, 100), n_ops = gen_len_bw(0, 400);
+	char** keys = malloc(n_pool * sizeof keys[0]);
+	size_t* sizes = calloc(n_ops + 1, sizeof sizes[0]);
+	const char* shared = rand()&1 ? "/tenant/" : "";
+	for (size_t i=0; i<n_pool; ++i) {
+		char* suffix = gen_rand_str(gen_len_bw(0, rand()&1 ? 4 : 30));
+		keys[i] = add_strs(NULL, shared, strlen(shared), suffix,
+				   strlen(suffix));
+		free(suffix);
+	}
+
+	/* Two rounds so that deletions find keys to remove */
+	bool results = true;
+	for (size_t round=0; round<2; ++round) {
+		struct TrieBatchOp* ops = malloc((n_ops + 1) * sizeof ops[0]);
+		for (size_t i=0; i<n_ops; ++i) {
+			ops[i].key = keys[rand() % n_pool];
+			ops[i].len = strlen(ops[i].key);
+			ops[i].kind = rand() % 3 ? TRIE_BATCH_INSERT
+						 : TRIE_BATCH_DELETE;
+			ops[i].value = rand() % 50 ? &sizes[i] : NULL;
+		}
+		size_t n_failed = trie_apply_batch(batched, ops, n_ops);
+
+		size_t n_serial_failed = 0;
+		for (size_t i=0; i<n_ops; ++i) {
+			int rc = ops[i].kind == TRIE_BATCH_INSERT
+				 ? trie_insert_n(serial, ops[i].key,
+						 ops[i].len, ops[i].value)
+				 : trie_delete_n(serial, ops[i].key,
+						 ops[i].len);
+			results = results && rc == ops[i].result;
+			n_serial_failed += rc != 0;
+		}
+		results = results && n_failed == n_serial_failed;
+		free(ops);
+	}
+	test_check(res, "Results match single-key calls", results);
+
+	bool values = true;
+	for (size_t i=0; i<n_pool; ++i)
+		values = values && trie_find(batched, keys[i])
+				   == trie_find(serial, keys[i]);
+	test_check(res, "Batch leaves the same keys and values", values);
+	test_check(res, "Batch leaves the same structure",
+		   tries_equal(batched->root, serial->root)
+		   && node_kind_consistent(batched->root));
+
+	size_t n_nodes = 0, n_keys = 0, value_bytes = 0;
+	count_nodes(batched->root, &n_nodes, &n_keys, &value_bytes);
+	test_check(res, "Batch keeps the counters",
+		   trie_stats(batched).n_keys == n_keys
+		   && trie_stats(batched).n_nodes == n_nodes);
+	test_check(res, "Batch keeps the root table",
+		   !(flags & TRIE_ROOT_TABLE)
+		   || root_table_consistent(batched));
+
+	trie_destroy(batched);
+	trie_destroy(serial);
+	for (size_t i=0; i<n_pool; ++i)
+		free(keys[i]);
+	free(keys);
+	free(sizes);
+}
+
+
+TEST_DEFINE(test_find_batch, res)
+{
+	TEST_AUTONAME(res);
+
+	Trie* trie = trie_create_flags(TRIE_OPS_NONE, rand() & 3);
+	size_t n_keys = gen_len_bw(0, 600);
+	char** keys = calloc(n_keys + 1, sizeof keys[0]);
+	size_t* lens = calloc(n_keys + 1, sizeof lens[0]);
+	void** values = malloc((n_keys + 1) * sizeof values[0]);
+	for (size_t i=0; i<n_keys; ++i) {
+		keys[i] = gen_rand_str(gen_len_bw(0, rand()&1 ? 3 : 40));
+		if (rand() & 1)
+			trie_insert(trie, keys[i], keys[i]);
+	}
+
+	/* Prefixes of keys miss inside segments and at nodes without values */
+	size_t n_found = 0;
+	for (size_t i=0; i<n_keys; ++i) {
+		lens[i] = strlen(keys[i]);
+		if (rand() % 4 == 0)
+			lens[i] = gen_len_bw(0, lens[i]);
+		n_found += trie_find_n(trie, keys[i], lens[i]) != NULL;
+	}
+	bool use_lens = rand() & 1;
+	if (!use_lens)
+		for (size_t i=0; i<n_keys; ++i)
+			keys[i][lens[i]] = '\0';
+
+	bool same = trie_find_batch(trie, (const char* const*)keys,
+				    use_lens ? lens : NULL, n_keys, values)
+		    == n_found;
+	for (size_t i=0; i<n_keys; ++i)
+		same = same && values[i] == trie_find_n(trie, keys[i], lens[i]);
+	test_check(res, "Batch finds the same values as single lookups", same);
+
+	trie_destroy(trie);
+	for (size_t i=0; i<n_keys; ++i)
+		free(keys[i]);
+	free(keys);
+	free(lens);
+	free(values);
+}
+
+
+TEST_DEFINE(test_upsert, res)
+{
+	TEST_AUTONAME(res);
+
+	unsigned flags = rand() & 3;
+	Trie* upserted = trie_create_flags(TRIE_OPS_NONE, flags);
+	Trie* inserted = trie_create_flags(TRIE_OPS_NONE, flags);
+	size_t n_pool = gen_len_bw(1, 100), n_ops = gen_len_bw(0, 300);
+	char** keys = malloc(n_pool * sizeof keys[0]);
+	size_t* counts = calloc(n_pool, sizeof counts[0]);
+	for (size_t i=0; i<n_pool; ++i)
+		keys[i] = gen_rand_str(gen_len_bw(0, rand()&1 ? 4 : 30));
+
+	/* Counting keys is the find-or-insert workload upserts are for */
+	bool flags_right = true, slots_right = true;
+	for (size_t i=0; i<n_ops; ++i) {
+		size_t k = (size_t)rand() % n_pool;
+		void* value = trie_find(inserted, keys[k]);
+		int was_added = -1;
+		void** slot = trie_upsert(upserted, keys[k], &was_added);
+		if (!slot)
+			continue;
+		flags_right = flags_right && was_added == !value;
+		if (was_added && rand() % 10 == 0) {
+			/* A caller without a value takes the key back out */
+			slots_right = slots_right && *slot == NULL;
+			trie_delete(upserted, keys[k]);
+			continue;
+		}
+		if (was_added) {
+			slots_right = slots_right && *slot == NULL;
+			*slot = &counts[k];
+			trie_insert(inserted, keys[k], &counts[k]);
+		} else {
+			slots_right = slots_right && *slot == value;
+		}
+		++*(size_t*)*slot;
+		if (rand() % 10 == 0) {
+			k = (size_t)rand() % n_pool;
+			trie_delete(upserted, keys[k]);
+			trie_delete(inserted, keys[k]);
+		}
+	}
+	test_check(res, "Upsert reports whether it added the key", flags_right);
+	test_check(res, "Upsert returns the slot of the value", slots_right);
+	test_check(res, "Upsert leaves the same structure as insert",
+		   tries_equal(upserted->root, inserted->root)
+		   && node_kind_consistent(upserted->root));
+
+	size_t n_nodes = 0, n_keys = 0, value_bytes = 0;
+	count_nodes(upserted->root, &n_nodes, &n_keys, &value_bytes);
+	test_check(res, "Upsert keeps the counters",
+		   trie_stats(upserted).n_keys == n_keys
+		   && trie_stats(upserted).n_nodes == n_nodes);
+	test_check(res, "Upsert keeps the root table",
+		   !(flags & TRIE_ROOT_TABLE)
+		   || root_table_consistent(upserted));
+
+	/* Values grow through their slots after the upsert returns */
+	Trie* measured = trie_create(trie_makeops(NULL, value_size));
+	size_t* sizes = calloc(n_pool, sizeof sizes[0]);
+	for (size_t i=0; i<n_ops; ++i) {
+		size_t k = (size_t)rand() % n_pool;
+		int was_added;
+		void** slot = trie_upsert(measured, keys[k], &was_added);
+		if (!slot)
+			continue;
+		if (was_added)
+			*slot = &sizes[k];
+		++*(size_t*)*slot;
+		if (rand() % 10 == 0)
+			trie_delete(measured, keys[(size_t)rand() % n_pool]);
+	}
+	value_bytes = 0;
+	count_nodes(measured->root, &n_nodes, &n_keys, &value_bytes);
+	test_check(res, "Upsert measures the values stored in its slots",
+		   trie_stats(measured).value_bytes == value_bytes);
+
+	trie_destroy(measured);
+	free(sizes);
+	trie_destroy(upserted);
+	trie_destroy(inserted);
+	for (size_t i=0; i<n_pool; ++i)
+		free(keys[i]);
+	free(keys);
+	free(counts);
+}
+
+
+TEST_DEFINE(test_delete_prefix, res)
+{
+	TEST_AUTONAME(res);
+
+	unsigned flags = rand() & 3;
+	Trie* pruned = trie_create_flags(trie_makeops(free, value_size), flags);
+	Trie* deleted = trie_create_flags(trie_makeops(free, value_size),
+					  flags);
+	size_t n_keys = gen_len_bw(1, 300);
+	char** keys = malloc(n_keys * sizeof keys[0]);
+	for (size_t i=0; i<n_keys; ++i) {
+		keys[i] = gen_rand_str(gen_len_bw(0, rand()&1 ? 4 : 30));
+		if (i > 0 && keys[i][0] && rand() % 2 == 0)
+			keys[i][0] = keys[i-1][0];
+		size_t* val1 = malloc(sizeof *val1);
+		size_t* val2 = malloc(sizeof *val2);
+		*val1 = *val2 = (size_t)(rand() % 1000);
+		trie_insert(pruned, keys[i], val1);
+		trie_insert(deleted, keys[i], val2);
+	}
+
+	/* Prefixes end at nodes, inside segments, past the keys or are empty */
+	bool removed = true;
+	for (size_t round=0; round<4; ++round) {
+		char* key = keys[(size_t)rand() % n_keys];
+		size_t len = rand() % 4 ? gen_len_bw(0, strlen(key)) : 1;
+		char* prefix = add_strs(NULL, key, len, "", 0);
+		if (rand() % 8 == 0)
+			prefix[0] = '\0';
+
+		size_t n_removed = 0;
+		for (size_t i=0; i<n_keys; ++i)
+			if (strncmp(keys[i], prefix, strlen(prefix)) == 0
+			    && trie_find(deleted, keys[i])) {
+				trie_delete(deleted, keys[i]);
+				++n_removed;
+			}
+		removed = removed
+			  && trie_delete_prefix(pruned, prefix) == n_removed;
+		free(prefix);
+	}
+	test_check(res, "Counts the keys removed", removed);
+	test_check(res, "Leaves the same structure as single deletions",
+		   tries_equal(pruned->root, deleted->root)
+		   && node_kind_consistent(pruned->root));
+
+	size_t n_nodes = 0, n_found = 0, value_bytes = 0;
+	count_nodes(pruned->root, &n_nodes, &n_found, &value_bytes);
+	struct TrieStats stats = trie_stats(pruned);
+	test_check(res, "Keeps the counters",
+		   stats.n_nodes == n_nodes && stats.n_keys == n_found
+		   && stats.value_bytes == value_bytes
+		   && stats.node_bytes == usage_recursive(pruned->root)
+		      + (pruned->root_table ? sizeof *pruned->root_table : 0));
+	test_check(res, "Keeps the root table",
+		   !(flags & TRIE_ROOT_TABLE) || root_table_consistent(pruned));
+
+	trie_destroy(pruned);
+	trie_destroy(deleted);
+	for (size_t i=0; i<n_keys; ++i)
+		free(keys[i]);
+	free(keys);
+}
+
+typedef struct MoveLog {
+	char** keys;
+	size_t* values;
+	size_t n_keys, skip;
+} MoveLog;
+
+static int collect_moved(const char* key, size_t keylen, void* value,
+			 void* ctx)
+{
+	MoveLog* log = ctx;
+	log->keys[log->n_keys] = add_strs(NULL, key + log->skip,
+					  keylen - log->skip, "", 0);
+	log->values[log->n_keys++] = *(size_t*)value;
+	return 0;
+}
+
+TEST_DEFINE(test_move_prefix, res)
+{
+	TEST_AUTONAME(res);
+
+	unsigned flags = rand() & 3;
+	struct TrieOps ops = trie_makeops(free, value_size);
+	Trie* grafted = trie_create_flags(ops, flags);
+	Trie* moved = trie_create_flags(ops, flags);
+	size_t n_keys = gen_len_bw(0, 300);
+	for (size_t i=0; i<n_keys; ++i) {
+		char* key = gen_rand_str(gen_len_bw(0, rand()&1 ? 4 : 30));
+		if (key[0] && rand() % 2 == 0)
+			key[0] = 'a';
+		size_t* val1 = malloc(sizeof *val1);
+		size_t* val2 = malloc(sizeof *val2);
+		*val1 = *val2 = (size_t)(rand() % 1000);
+		trie_insert(grafted, key, val1);
+		trie_insert(moved, key, val2);
+		free(key);
+	}
+
+	/* Prefixes end at nodes or inside segments, overlap each other or are
+	 * empty, and moved keys land on existing ones */
+	bool same_rc = true;
+	for (size_t round=0; round<4; ++round) {
+		char* from = gen_rand_str(gen_len_bw(0, 3));
+		char* to = gen_rand_str(gen_len_bw(0, 3));
+		if (from[0] && rand() % 2 == 0)
+			from[0] = 'a';
+		if (to[0] && rand() % 2 == 0)
+			to[0] = 'a';
+		if (rand() % 8 == 0)
+			from[0] = '\0';
+		if (rand() % 8 == 0)
+			to[0] = '\0';
+
+		/* Move one key at a time in the reference trie */
+		size_t n_all = trie_stats(moved).n_keys;
+		MoveLog log = { malloc((n_all + 1) * sizeof(char*)),
+				malloc((n_all + 1) * sizeof(size_t)), 0,
+				strlen(from) };
+		trie_foreach(moved, from, collect_moved, &log);
+		trie_delete_prefix(moved, from);
+		for (size_t i=0; i<log.n_keys; ++i) {
+			char* key = add_strs(NULL, to, strlen(to), log.keys[i],
+					     strlen(log.keys[i]));
+			size_t* val = malloc(sizeof *val);
+			*val = log.values[i];
+			trie_delete(moved, key);
+			trie_insert(moved, key, val);
+			free(key);
+			free(log.keys[i]);
+		}
+		free(log.keys);
+		free(log.values);
+
+		same_rc = same_rc && trie_move_prefix(grafted, from, to) == 0;
+		free(from);
+		free(to);
+	}
+	test_check(res, "Moves without running out of memory", same_rc);
+	test_check(res, "Leaves the same structure as moving single keys",
+		   tries_equal(grafted->root, moved->root)
+		   && node_kind_consistent(grafted->root));
+
+	size_t n_all = trie_stats(moved).n_keys;
+	MoveLog log1 = { malloc((n_all + 1) * sizeof(char*)),
+			 malloc((n_all + 1) * sizeof(size_t)), 0, 0 };
+	MoveLog log2 = { malloc((n_all + 1) * sizeof(char*)),
+			 malloc((n_all + 1) * sizeof(size_t)), 0, 0 };
+	trie_foreach(moved, "", collect_moved, &log1);
+	bool same_values = trie_stats(grafted).n_keys == n_all;
+	if (same_values)
+		trie_foreach(grafted, "", collect_moved, &log2);
+	same_values = same_values && log1.n_keys == log2.n_keys;
+	for (size_t i=0; i<log1.n_keys; ++i)
+		same_values = same_values
+			      && strcmp(log1.keys[i], log2.keys[i]) == 0
+			      && log1.values[i] == log2.values[i];
+	test_check(res, "Keys keep their values", same_values);
+	for (size_t i=0; i<log1.n_keys; ++i)
+		free(log1.keys[i]);
+	for (size_t i=0; i<log2.n_keys; ++i)
+		free(log2.keys[i]);
+	free(log1.keys);
+	free(log1.values);
+	free(log2.keys);
+	free(log2.values);
+
+	size_t n_nodes = 0, n_found = 0, value_bytes = 0;
+	count_nodes(grafted->root, &n_nodes, &n_found, &value_bytes);
+	struct TrieStats stats = trie_stats(grafted);
+	size_t table_bytes = grafted->root_table ? sizeof *grafted->root_table
+						 : 0;
+	test_check(res, "Keeps the counters",
+		   stats.n_nodes == n_nodes && stats.n_keys == n_found
+		   && stats.value_bytes == value_bytes
+		   && stats.node_bytes == usage_recursive(grafted->root)
+					  + table_bytes);
+	test_check(res, "Keeps the root table",
+		   !(flags & TRIE_ROOT_TABLE)
+		   || root_table_consistent(grafted));
+
+	trie_destroy(grafted);
+	trie_destroy(moved);
+}
+
+
+static void* sum_values(void* dst_value, void* src_value)
+{
+	*(size_t*)dst_value += *(size_t*)src_value;
+	return dst_value;
+}
+
+TEST_DEFINE(test_merge, res)
+{
+	TEST_AUTONAME(res);
+
+	struct TrieOps ops = trie_makeops(free, value_size);
+	Trie* dst = trie_create_flags(ops, rand() & 3);
+	Trie* src = trie_create_flags(ops, rand() & 3);
+	Trie* ref = trie_create_flags(ops, dst->flags);
+	size_t n_keys = gen_len_bw(0, 300);
+	for (size_t i=0; i<n_keys; ++i) {
+		char* key = gen_rand_str(gen_len_bw(0, rand()&1 ? 4 : 30));
+		if (key[0] && rand() % 2 == 0)
+			key[0] = 'a';
+		size_t* val = malloc(sizeof *val);
+		*val = (size_t)(rand() % 1000);
+		if (rand() % 2) {
+			size_t* copy = malloc(sizeof *copy);
+			*copy = *val;
+			trie_insert(dst, key, val);
+			trie_insert(ref, key, copy);
+		} else {
+			trie_insert(src, key, val);
+		}
+		free(key);
+	}
+
+	/* Keys in both tries take the resolved value or the value of src */
+	TrieResolver resolve = rand() % 2 ? sum_values : NULL;
+	size_t n_src = trie_stats(src).n_keys;
+	MoveLog log = { malloc((n_src + 1) * sizeof(char*)),
+			malloc((n_src + 1) * sizeof(size_t)), 0, 0 };
+	trie_foreach(src, "", collect_moved, &log);
+	for (size_t i=0; i<log.n_keys; ++i) {
+		size_t* val = trie_find(ref, log.keys[i]);
+		if (val && resolve) {
+			*val += log.values[i];
+		} else {
+			val = malloc(sizeof *val);
+			*val = log.values[i];
+			trie_insert(ref, log.keys[i], val);
+		}
+		free(log.keys[i]);
+	}
+	free(log.keys);
+	free(log.values);
+
+	test_check(res, "Merges without running out of memory",
+		   trie_merge(dst, src, resolve) == 0);
+	test_check(res, "Leaves the same structure as single insertions",
+		   tries_equal(dst->root, ref->root)
+		   && node_kind_consistent(dst->root));
+
+	size_t n_all = trie_stats(ref).n_keys;
+	MoveLog log1 = { malloc((n_all + 1) * sizeof(char*)),
+			 malloc((n_all + 1) * sizeof(size_t)), 0, 0 };
+	MoveLog log2 = { malloc((n_all + 1) * sizeof(char*)),
+			 malloc((n_all + 1) * sizeof(size_t)), 0, 0 };
+	trie_foreach(ref, "", collect_moved, &log1);
+	bool same_values = trie_stats(dst).n_keys == n_all;
+	if (same_values)
+		trie_foreach(dst, "", collect_moved, &log2);
+	same_values = same_values && log1.n_keys == log2.n_keys;
+	for (size_t i=0; i<log1.n_keys; ++i)
+		same_values = same_values
+			      && strcmp(log1.keys[i], log2.keys[i]) == 0
+			      && log1.values[i] == log2.values[i];
+	test_check(res, "Keys get the resolved values", same_values);
+	for (size_t i=0; i<log1.n_keys; ++i)
+		free(log1.keys[i]);
+	for (size_t i=0; i<log2.n_keys; ++i)
+		free(log2.keys[i]);
+	free(log1.keys);
+	free(log1.values);
+	free(log2.keys);
+	free(log2.values);
+
+	size_t n_nodes = 0, n_found = 0, value_bytes = 0;
+	count_nodes(dst->root, &n_nodes, &n_found, &value_bytes);
+	struct TrieStats stats = trie_stats(dst);
+	size_t table_bytes = dst->root_table ? sizeof *dst->root_table : 0;
+	test_check(res, "Keeps the counters",
+		   stats.n_nodes == n_nodes && stats.n_keys == n_found
+		   && stats.value_bytes == value_bytes
+		   && stats.node_bytes == usage_recursive(dst->root)
+					  + table_bytes);
+	test_check(res, "Keeps the root table",
+		   !(dst->flags & TRIE_ROOT_TABLE)
+		   || root_table_consistent(dst));
+
+	stats = trie_stats(src);
+	table_bytes = src->root_table ? sizeof *src->root_table : 0;
+	test_check(res, "Leaves the source empty",
+		   stats.n_keys == 0 && stats.n_nodes == 1
+		   && !src->root->value && !src->root->n_children
+		   && stats.node_bytes == usage_recursive(src->root)
+					  + table_bytes
+		   && (!(src->flags & TRIE_ROOT_TABLE)
+		       || root_table_consistent(src)));
+
+	trie_destroy(dst);
+	trie_destroy(src);
+	trie_destroy(ref);
+}
+
+
 TEST_START
 (
 	test_instantiation,
 	asan_test_destroy,
 	test_max_keylen,
 	test_node_create,
+	test_segment_layout,
 	test_insert,
 	test_delete,
+	test_arena,
+	test_deep_walk,
+	test_stats,
+	test_root_table,
+	test_node_kinds,
+	test_child_capacity,
 	test_find,
+	test_binary_keys,
+	test_pflen,
 	test_segncpy,
-	test_key_add_segment,
+	test_unbounded_iter,
 	asan_test_iter_destroy,
 	test_iterator,
+	test_reverse_iter,
+	test_seek,
+	test_range,
+	test_foreach,
+	test_split,
+	test_walker,
+	test_build_sorted,
+	test_apply_batch,
+	test_find_batch,
+	test_upsert,
+	test_delete_prefix,
+	test_move_prefix,
+	test_merge,
 )